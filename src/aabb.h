@@ -71,6 +71,18 @@ class aabb { // * axis-aligned bounding box
             return true;
         }
 
+        point3 centroid() const {
+            // returns the center point of the bounding box
+            return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+        }
+
+        double surface_area() const {
+            // * surface area of the box, used by the SAH cost model (an empty box has no area)
+            auto dx = x.size(), dy = y.size(), dz = z.size();
+            if (dx < 0 || dy < 0 || dz < 0) return 0;
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
         int longest_axis() const {
             // returns the index of the longest axis of the bounding box
 
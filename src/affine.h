@@ -0,0 +1,149 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+// * 3x4 affine transform: a 3x3 linear part and a translation in the last column.
+// Points get the translation, vectors do not, normals use the inverse transpose.
+// Transforms compose like matrices: (a * b) applies b first, then a.
+class affine3 {
+    public:
+        double m[3][4]; // row-major, m[i][3] is the translation
+
+        // identity by default
+        affine3() : m{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} } {}
+
+        static affine3 translation(const vec3& offset) {
+            affine3 a;
+            for (int i = 0; i < 3; i++) a.m[i][3] = offset[i];
+            return a;
+        }
+
+        static affine3 scaling(const vec3& s) {
+            affine3 a;
+            for (int i = 0; i < 3; i++) a.m[i][i] = s[i];
+            return a;
+        }
+
+        static affine3 scaling(double s) { return scaling(vec3(s, s, s)); }
+
+        // * rotations by an angle in degrees, matching rotate_x / rotate_y / rotate_z exactly
+        // (so rotation_x and rotation_z turn the opposite way of rotation_y's right-hand rule)
+        static affine3 rotation_x(double angle) {
+            auto [s, c] = sin_cos(angle);
+            affine3 a;
+            a.m[1][1] = c;  a.m[1][2] = s;
+            a.m[2][1] = -s; a.m[2][2] = c;
+            return a;
+        }
+
+        static affine3 rotation_y(double angle) {
+            auto [s, c] = sin_cos(angle);
+            affine3 a;
+            a.m[0][0] = c;  a.m[0][2] = s;
+            a.m[2][0] = -s; a.m[2][2] = c;
+            return a;
+        }
+
+        static affine3 rotation_z(double angle) {
+            auto [s, c] = sin_cos(angle);
+            affine3 a;
+            a.m[0][0] = c;  a.m[0][1] = s;
+            a.m[1][0] = -s; a.m[1][1] = c;
+            return a;
+        }
+
+        friend affine3 operator*(const affine3& a, const affine3& b) {
+            affine3 r;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+                }
+                r.m[i][3] += a.m[i][3];
+            }
+            return r;
+        }
+
+        point3 point(const point3& p) const {
+            return point3(row_dot(0, p) + m[0][3], row_dot(1, p) + m[1][3], row_dot(2, p) + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(row_dot(0, v), row_dot(1, v), row_dot(2, v));
+        }
+
+        // * normal transform, to be called on the *inverse* matrix: n' = (M^-1)^T n
+        vec3 normal_from_inverse(const vec3& n) const {
+            return vec3(m[0][0] * n[0] + m[1][0] * n[1] + m[2][0] * n[2],
+                        m[0][1] * n[0] + m[1][1] * n[1] + m[2][1] * n[2],
+                        m[0][2] * n[0] + m[1][2] * n[1] + m[2][2] * n[2]);
+        }
+
+        // * box enclosing the transformed box (Arvo: per-axis min/max of the linear part)
+        aabb box(const aabb& b) const {
+            interval axes[3];
+            for (int i = 0; i < 3; i++) {
+                double lo = m[i][3], hi = m[i][3];
+                for (int j = 0; j < 3; j++) {
+                    double e = m[i][j] * b.axis_interval(j).min;
+                    double f = m[i][j] * b.axis_interval(j).max;
+                    lo += std::fmin(e, f);
+                    hi += std::fmax(e, f);
+                }
+                axes[i] = interval(lo, hi);
+            }
+            return aabb(axes[0], axes[1], axes[2]);
+        }
+
+        // * common scale factor of the linear part if it is a rotation times a uniform scale
+        // * (columns orthogonal and of equal length), 0 otherwise
+        double uniform_scale() const {
+            vec3 c0(m[0][0], m[1][0], m[2][0]), c1(m[0][1], m[1][1], m[2][1]), c2(m[0][2], m[1][2], m[2][2]);
+            double s2 = c0.length_squared();
+            double tolerance = 1e-12 * s2;
+            if (std::fabs(c1.length_squared() - s2) > tolerance || std::fabs(c2.length_squared() - s2) > tolerance
+                || std::fabs(dot(c0, c1)) > tolerance || std::fabs(dot(c1, c2)) > tolerance
+                || std::fabs(dot(c0, c2)) > tolerance)
+                return 0;
+            return std::sqrt(s2);
+        }
+
+        // * inverse of the transform; the linear part must not be singular
+        affine3 inverse() const {
+            double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+            double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+            double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+            double inv_det = 1.0 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+            affine3 r;
+            r.m[0][0] = c00 * inv_det;
+            r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+            r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+            r.m[1][0] = c01 * inv_det;
+            r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+            r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+            r.m[2][0] = c02 * inv_det;
+            r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+            r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+            // the translation moves back through the inverted linear part
+            vec3 t = r.vector(vec3(m[0][3], m[1][3], m[2][3]));
+            for (int i = 0; i < 3; i++) r.m[i][3] = -t[i];
+            return r;
+        }
+
+    private:
+        double row_dot(int i, const vec3& v) const {
+            return m[i][0] * v[0] + m[i][1] * v[1] + m[i][2] * v[2];
+        }
+
+        struct sin_cos_pair { double s, c; };
+        static sin_cos_pair sin_cos(double angle) {
+            auto radians = degrees_to_radians(angle);
+            return { std::sin(radians), std::cos(radians) };
+        }
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include "rtweekend.h"
+#include "framebuffer.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// * Arbitrary output variables: images written next to the beauty image from the same samples.
+// emission + direct + indirect add up to the beauty image (emission: light seen straight from
+// the camera, direct: light after one scattering, indirect: after two or more). The IDs
+// number objects and materials in creation order, so a scene gets the same IDs on every run;
+// primitive IDs also tell the faces of a mesh and the placements of an instance apart. They are
+// written as a distinct colour per ID (black for the background).
+enum class aov_type { depth, normal, albedo, emission, direct, indirect, primitive_id, material_id, sample_count };
+
+constexpr int aov_type_count = 9;
+
+inline const char* aov_name(aov_type type) {
+    static const char* names[aov_type_count] = {
+        "depth", "normal", "albedo", "emission", "direct", "indirect", "primitive_id", "material_id", "sample_count"
+    };
+    return names[int(type)];
+}
+
+// * false for an unknown name
+inline bool aov_from_name(const std::string& name, aov_type& type) {
+    for (int k = 0; k < aov_type_count; k++) {
+        if (name == aov_name(aov_type(k))) {
+            type = aov_type(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+constexpr uint32_t aov_bit(aov_type type) { return 1u << int(type); }
+
+
+// * what one camera sample saw, filled in by camera::ray_color when it is given one
+struct aov_sample {
+    double depth = 0;         // distance to the first hit, 0 for misses
+    vec3 normal;              // world-space shading normal at the first hit, zero for misses
+    color albedo;             // reflectance at the first hit; emission of lights, background of misses
+    color emission, direct, indirect;
+    uint32_t primitive_id = 0, material_id = 0; // 0: the ray left the scene
+};
+
+// * a distinct colour per ID for the ID images, black for 0
+inline color id_color(uint32_t id) {
+    if (id == 0) return color(0, 0, 0);
+    uint32_t h = hash32(id);
+    return color((h & 0xff) / 255.0, ((h >> 8) & 0xff) / 255.0, ((h >> 16) & 0xff) / 255.0);
+}
+
+
+// * Per-pixel sums of the enabled AOVs. A disabled AOV has a null buffer: it costs no memory
+// and add() skips it. Different pixels may be added from different threads.
+class aov_buffers {
+    public:
+        aov_buffers() = default;
+
+        // enabled: aov_bit()s of the AOVs to keep
+        aov_buffers(int width, int height, uint32_t enabled) : counts(size_t(width) * height, 0) {
+            for (int k = 0; k < aov_type_count; k++)
+                if (enabled & aov_bit(aov_type(k)))
+                    buffers[k] = std::make_unique<framebuffer>(width, height);
+        }
+
+        bool enabled(aov_type type) const { return buffers[int(type)] != nullptr; }
+
+        bool any() const {
+            for (const auto& buffer : buffers)
+                if (buffer) return true;
+            return false;
+        }
+
+        void add(size_t p, const aov_sample& s) {
+            accumulate(aov_type::depth, p, color(s.depth, s.depth, s.depth));
+            accumulate(aov_type::normal, p, s.normal);
+            accumulate(aov_type::albedo, p, s.albedo);
+            accumulate(aov_type::emission, p, s.emission);
+            accumulate(aov_type::direct, p, s.direct);
+            accumulate(aov_type::indirect, p, s.indirect);
+            // an ID cannot be averaged: the pixel keeps the one of its first sample
+            if (counts[p] == 0) {
+                if (auto& ids = buffers[int(aov_type::primitive_id)]) ids->set(p, id_color(s.primitive_id));
+                if (auto& ids = buffers[int(aov_type::material_id)]) ids->set(p, id_color(s.material_id));
+            }
+            counts[p]++;
+        }
+
+        // * the finished image of an enabled AOV: means of the summed ones, IDs and counts as is
+        framebuffer resolve(aov_type type) const {
+            const framebuffer& sums = *buffers[int(type)];
+            framebuffer image(sums.width, sums.height);
+            for (size_t p = 0; p < counts.size(); p++) {
+                for (int c = 0; c < 3; c++) {
+                    size_t k = 3 * p + c;
+                    if (type == aov_type::sample_count)
+                        image.rgb[k] = float(counts[p]);
+                    else if (type == aov_type::primitive_id || type == aov_type::material_id)
+                        image.rgb[k] = sums.rgb[k];
+                    else
+                        image.rgb[k] = counts[p] ? sums.rgb[k] / float(counts[p]) : 0.0f;
+                }
+            }
+            return image;
+        }
+
+    private:
+        std::array<std::unique_ptr<framebuffer>, aov_type_count> buffers;
+        std::vector<uint32_t> counts; // samples added per pixel
+
+        void accumulate(aov_type type, size_t p, const vec3& value) {
+            framebuffer* sums = buffers[int(type)].get();
+            if (!sums) return;
+            sums->rgb[3*p]   += float(value.x());
+            sums->rgb[3*p+1] += float(value.y());
+            sums->rgb[3*p+2] += float(value.z());
+        }
+};
+
+#endif
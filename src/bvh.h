@@ -8,97 +8,506 @@
 #include "hittable_list.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
-class bvh_node : public hittable { // * define bvh node representation from hittable
+// * strategy used to split the objects of a node into two children
+enum class bvh_split {
+    median, // sort along the longest axis and cut at the middle object
+    sah     // binned Surface Area Heuristic
+};
+
+
+// * compact node of the flattened bvh: 32 bytes, so two nodes share one cache line
+// Interior nodes store their first child right after themselves and the index of the
+// second child in `offset`; leaves store a range [offset, offset + count) of primitives.
+struct alignas(32) linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset; // leaf: first primitive slot, interior: index of the second child
+    uint16_t count;  // number of primitives, 0 for interior nodes
+    uint8_t axis;    // split axis of interior nodes, used to visit the nearer child first
+    uint8_t pad;
+
+    void set_bounds(const aabb& box) {
+        // * round outwards, so the float box always contains the double one
+        for (int a = 0; a < 3; a++) {
+            const interval& ax = box.axis_interval(a);
+            float lo = float(ax.min), hi = float(ax.max);
+            if (double(lo) > ax.min) lo = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+            if (double(hi) < ax.max) hi = std::nextafter(hi, std::numeric_limits<float>::infinity());
+            bounds_min[a] = lo;
+            bounds_max[a] = hi;
+        }
+    }
+
+    // * slab test against a precomputed inverse direction
+    bool hit(const point3& orig, const vec3& inv_dir, const interval& ray_t) const {
+        double t_min = ray_t.min, t_max = ray_t.max;
+        for (int a = 0; a < 3; a++) {
+            double t0 = (bounds_min[a] - orig[a]) * inv_dir[a];
+            double t1 = (bounds_max[a] - orig[a]) * inv_dir[a];
+            if (t0 > t1) std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max <= t_min) return false;
+        }
+        return true;
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+
+// * Builds a flattened bvh over any set of primitives, given only their bounding boxes.
+// The result is a depth-first node array plus the primitive order referenced by the leaves.
+// Large builds run in parallel: subtrees become OpenMP tasks, and the top levels (where
+// there are not yet enough subtrees to keep all cores busy) bin their objects in chunks.
+class bvh_builder {
     public:
-        bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {} // * constructor with hittable list
-        // There's a C++ subtlety here. This constructor (without span indices) creates an
-        // implicit copy of the hittable list, which we will modify. The lifetime of the copied
-        // list only extends until this constructor exits. That's OK, because we only need to
-        // persist the resulting bounding volume hierarchy.
+        // * SAH build parameters
+        static constexpr int      sah_bins       = 16;  // candidate split planes per axis (+1)
+        static constexpr uint32_t max_leaf_size  = 4;   // a node is never a leaf above this many objects
+        static constexpr double   traversal_cost = 1.0; // relative cost of one box test ...
+        static constexpr double   intersect_cost = 1.0; // ... against one object intersection
+        static constexpr int      max_depth      = 48;  // deeper nodes are split by count (keeps the stack bounded)
+
+        // * parallel build parameters
+        static constexpr uint32_t task_threshold  = 4096;    // spans above this build their children as tasks
+        static constexpr uint32_t chunk_threshold = 1 << 16; // spans above this are binned in parallel chunks
+        static constexpr uint32_t chunk_size      = 1 << 14; // objects per chunk
+
+        std::vector<linear_bvh_node> nodes; // flattened nodes, the root is nodes[0]
+        std::vector<uint32_t> order;         // primitive slot -> index into the input boxes
+
+        bvh_builder(const std::vector<aabb>& prim_bounds, bvh_split method)
+         : bounds(prim_bounds), method(method) {
+            auto n = uint32_t(bounds.size());
+            order.resize(n);
+            centroids.resize(n);
+
+            #pragma omp parallel for schedule(static) if (n >= chunk_threshold)
+            for (int64_t i = 0; i < int64_t(n); i++) {
+                order[i] = uint32_t(i);
+                centroids[i] = bounds[i].centroid();
+            }
+
+            if (n == 0) return;
+
+            std::unique_ptr<build_node> root;
+            #pragma omp parallel if (n >= task_threshold)
+            #pragma omp single
+            root = build(0, n, 0);
+
+            nodes.reserve(node_count.load());
+            flatten(*root);
+        }
+
+    private:
+        struct build_node {
+            aabb bounds;
+            std::unique_ptr<build_node> child[2];
+            uint32_t first = 0, count = 0; // primitive range of leaves
+            int axis = 0;
+        };
+
+        struct sah_bin {
+            aabb bounds = aabb::empty;
+            uint32_t count = 0;
+        };
+
+        const std::vector<aabb>& bounds;
+        std::vector<point3> centroids;
+        bvh_split method;
+        std::atomic<size_t> node_count{0};
 
-        bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
+        std::unique_ptr<build_node> make_leaf(aabb box, uint32_t start, uint32_t end) {
+            auto node = std::make_unique<build_node>();
+            node->bounds = box;
+            node->first = start;
+            node->count = end - start;
+            node_count++;
+            return node;
+        }
+
+        std::unique_ptr<build_node> build(uint32_t start, uint32_t end, int depth) {
             // Build the bounding box of the span of source objects
-            bbox = aabb::empty;
-            for (size_t object_index = start; object_index < end; object_index++) {
-                bbox = aabb(bbox, objects[object_index]->bounding_box());
+            aabb box = span_bounds(start, end);
+
+            uint32_t object_span = end - start;
+            uint32_t leaf_size = method == bvh_split::sah ? max_leaf_size : 2;
+            if (object_span == 1 || (method == bvh_split::median && object_span <= leaf_size))
+                return make_leaf(box, start, end);
+
+            int axis;
+            uint32_t mid;
+            if (method == bvh_split::sah && depth < max_depth) {
+                if (!split_sah(box, start, end, axis, mid))
+                    return make_leaf(box, start, end);
+            } else {
+                axis = box.longest_axis();
+                mid = start + object_span / 2;
+                // * the old median split: order by the box minimum along the longest axis
+                std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                    [&](uint32_t a, uint32_t b) {
+                        return bounds[a].axis_interval(axis).min < bounds[b].axis_interval(axis).min;
+                    });
             }
-            
-            // int axis = random_int(0, 2); // randomly choose an axis (0, 1, 2): (x, y, z)
-            int axis = bbox.longest_axis(); // choose the longest axis of the bounding box
-            
-            // compare function for sorting the objects (based on the specified axis)
-            auto comparator = (axis == 0) ? box_x_compare
-                            : (axis == 1) ? box_y_compare
-                                          : box_z_compare;
-
-            size_t object_span = end - start; // number of objects in the span
-
-            if (object_span == 1) { // if there is only one object
-                left = right = objects[start]; //put the object in both left and right child
-            } else if (object_span == 2) { // if there are two objects
-                left = objects[start]; // put the first object in the left child
-                right = objects[start+1]; // put the second object in the right child
+
+            auto node = std::make_unique<build_node>();
+            node->bounds = box;
+            node->axis = axis;
+            if (object_span >= task_threshold) {
+                // * build the two subtrees concurrently
+                auto* left = &node->child[0];
+                #pragma omp task shared(left) firstprivate(start, mid, depth)
+                *left = build(start, mid, depth + 1);
+                node->child[1] = build(mid, end, depth + 1);
+                #pragma omp taskwait
             } else {
-                // if there are more than two objects, sort the objects based on the axis
-                std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+                node->child[0] = build(start, mid, depth + 1);
+                node->child[1] = build(mid, end, depth + 1);
+            }
+            node_count++;
+            return node;
+        }
+
+        // * Run accumulate(lo, hi, partial) over [start, end) and combine the partial results
+        // with merge(total, partial). Big spans are cut into chunks that run as OpenMP tasks.
+        template <typename T, typename Accumulate, typename Merge>
+        T chunked_reduce(uint32_t start, uint32_t end, const T& init,
+                         Accumulate&& accumulate, Merge&& merge) const {
+            uint32_t span = end - start;
+            if (span < chunk_threshold) {
+                T result = init;
+                accumulate(start, end, result);
+                return result;
+            }
+
+            uint32_t chunks = (span + chunk_size - 1) / chunk_size;
+            std::vector<T> partial(chunks, init);
 
-                auto mid = start + object_span/2; // find the middle index of the span (a simple way)
-                left = make_shared<bvh_node>(objects, start, mid); //recursively build the left child
-                right = make_shared<bvh_node>(objects, mid, end); // recursively build the right child
+            // locals of an orphaned task are firstprivate by default, so results must be shared
+            #pragma omp taskloop grainsize(1) shared(partial, accumulate)
+            for (uint32_t c = 0; c < chunks; c++) {
+                uint32_t lo = start + c * chunk_size;
+                accumulate(lo, std::min(end, lo + chunk_size), partial[c]);
             }
 
-            // ! Deprecated: combine the bounding box of the left and right child to get the bounding box of the current node
-            // bbox = aabb(left->bounding_box(), right->bounding_box());
+            T result = init;
+            for (const auto& p : partial)
+                merge(result, p);
+            return result;
         }
 
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            // * if the ray does not hit the bounding box, return false
-            if (!bbox.hit(r, ray_t)) return false;
+        aabb span_bounds(uint32_t start, uint32_t end) const {
+            return chunked_reduce(start, end, aabb::empty,
+                [&](uint32_t lo, uint32_t hi, aabb& box) {
+                    for (uint32_t i = lo; i < hi; i++)
+                        box = aabb(box, bounds[order[i]]);
+                },
+                [](aabb& box, const aabb& other) { box = aabb(box, other); });
+        }
+
+        // * Binned SAH: returns false when the span should stay a leaf, otherwise
+        // * partitions [start, end) at `mid` along `axis`.
+        bool split_sah(const aabb& box, uint32_t start, uint32_t end, int& axis, uint32_t& mid) {
+            uint32_t object_span = end - start;
+
+            // bin the objects by centroid; the centroid bounds are not an aabb so they stay unpadded
+            using centroid_extent = std::array<interval, 3>;
+            centroid_extent centroid_bounds = chunked_reduce(start, end, centroid_extent{},
+                [&](uint32_t lo, uint32_t hi, centroid_extent& cb) {
+                    for (uint32_t i = lo; i < hi; i++) {
+                        const point3& c = centroids[order[i]];
+                        for (int a = 0; a < 3; a++)
+                            cb[a] = interval(cb[a], interval(c[a], c[a]));
+                    }
+                },
+                [](centroid_extent& cb, const centroid_extent& other) {
+                    for (int a = 0; a < 3; a++)
+                        cb[a] = interval(cb[a], other[a]);
+                });
+
+            // * bin all three axes in one pass over the objects
+            using bin_set = std::array<sah_bin, 3 * sah_bins>;
+            bin_set all_bins = chunked_reduce(start, end, bin_set{},
+                [&](uint32_t lo, uint32_t hi, bin_set& bins) {
+                    for (uint32_t i = lo; i < hi; i++) {
+                        uint32_t p = order[i];
+                        for (int a = 0; a < 3; a++) {
+                            if (centroid_bounds[a].size() <= 0) continue;
+                            auto& bin = bins[a * sah_bins + bin_index(centroids[p][a], centroid_bounds[a])];
+                            bin.bounds = aabb(bin.bounds, bounds[p]);
+                            bin.count++;
+                        }
+                    }
+                },
+                [](bin_set& bins, const bin_set& other) {
+                    for (size_t b = 0; b < bins.size(); b++) {
+                        bins[b].bounds = aabb(bins[b].bounds, other[b].bounds);
+                        bins[b].count += other[b].count;
+                    }
+                });
+
+            int best_axis = -1;
+            int best_split = 0; // objects in bins [0, best_split] go to the left child
+            double best_cost = infinity;
+
+            for (int a = 0; a < 3; a++) {
+                const interval& extent = centroid_bounds[a];
+                if (extent.size() <= 0) continue; // all centroids coincide on this axis
+
+                const sah_bin* bins = &all_bins[a * sah_bins];
+
+                // sweep from the right to get the area/count of every right side
+                double right_area[sah_bins];
+                uint32_t right_count[sah_bins];
+                aabb acc = aabb::empty;
+                uint32_t cnt = 0;
+                for (int b = sah_bins - 1; b > 0; b--) {
+                    acc = aabb(acc, bins[b].bounds);
+                    cnt += bins[b].count;
+                    right_area[b] = acc.surface_area();
+                    right_count[b] = cnt;
+                }
+
+                // then sweep from the left and evaluate every split plane
+                acc = aabb::empty;
+                cnt = 0;
+                for (int b = 0; b < sah_bins - 1; b++) {
+                    acc = aabb(acc, bins[b].bounds);
+                    cnt += bins[b].count;
+                    if (cnt == 0 || right_count[b+1] == 0) continue;
+
+                    double cost = acc.surface_area() * cnt + right_area[b+1] * right_count[b+1];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = a;
+                        best_split = b;
+                    }
+                }
+            }
 
-            // if hit, check the left and right child
-            bool hit_left = left->hit(r, ray_t, rec); // check left child
-            // reduce the interval of the ray to the hit point of the left child
-            bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec); // check right child
+            // SAH cost relative to the parent: C = C_trav + C_isect * (A_L*N_L + A_R*N_R) / A
+            double parent_area = box.surface_area();
+            double leaf_cost = intersect_cost * double(object_span);
+            double split_cost = parent_area > 0
+                              ? traversal_cost + intersect_cost * best_cost / parent_area
+                              : infinity;
 
-            return hit_left || hit_right; // return true if either left or right child is hit
+            // * termination: small spans become a leaf unless splitting is cheaper
+            if (object_span <= max_leaf_size && (best_axis < 0 || leaf_cost <= split_cost))
+                return false;
+
+            if (best_axis < 0) {
+                // every centroid is the same point: fall back to an even split by count
+                axis = box.longest_axis();
+                mid = start + object_span / 2;
+                return true;
+            }
+
+            const interval& extent = centroid_bounds[best_axis];
+            auto split_it = std::partition(order.begin() + start, order.begin() + end,
+                [&](uint32_t p) { return bin_index(centroids[p][best_axis], extent) <= best_split; });
+
+            axis = best_axis;
+            mid = uint32_t(split_it - order.begin());
+            return true;
         }
 
+        static int bin_index(double c, const interval& extent) {
+            int b = int(sah_bins * (c - extent.min) / extent.size());
+            return b < 0 ? 0 : (b >= sah_bins ? sah_bins - 1 : b);
+        }
 
-        // * bounding box of the bvh node, return current bounding box
-        aabb bounding_box() const override {
-            return bbox; // return the bounding box
+        // * depth-first layout: the first child directly follows its parent
+        uint32_t flatten(const build_node& node) {
+            auto index = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[index].set_bounds(node.bounds);
+            nodes[index].pad = 0;
+
+            if (node.count > 0) {
+                nodes[index].offset = node.first;
+                nodes[index].count = uint16_t(node.count);
+                nodes[index].axis = 0;
+            } else {
+                nodes[index].count = 0;
+                nodes[index].axis = uint8_t(node.axis);
+                flatten(*node.child[0]);
+                nodes[index].offset = flatten(*node.child[1]); // nodes may have reallocated
+            }
+            return index;
         }
-    
-    private:
-        shared_ptr<hittable> left; // left child
-        shared_ptr<hittable> right; // right child
-        aabb bbox; // bounding box of the current node
+};
+
+
+// * Explicit-stack traversal of a flattened bvh, shared by every structure built on it.
+// leaf_hit(first, count, ray_t) intersects one leaf and returns true on a hit, shrinking
+// ray_t.max to the new closest distance. With any_hit, the first leaf hit ends the traversal
+// (occlusion queries).
+template <bool any_hit = false, typename LeafHit>
+inline bool traverse_bvh(const std::vector<linear_bvh_node>& nodes, const ray& r, interval ray_t,
+                         LeafHit&& leaf_hit) {
+    if (nodes.empty()) return false;
+
+    const point3& orig = r.origin();
+    const vec3& dir = r.direction();
+    vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z()); // computed once per ray
+    bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+    uint32_t stack[bvh_builder::max_depth + 48]; // SAH levels plus a count split of up to 2^32 objects
+    int stack_size = 0;
+    uint32_t current = 0;
+    bool hit_anything = false;
+
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        if (node.hit(orig, inv_dir, ray_t)) {
+            if (node.count > 0) {
+                if (leaf_hit(node.offset, node.count, ray_t)) {
+                    if constexpr (any_hit) return true;
+                    hit_anything = true;
+                }
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            } else if (dir_is_neg[node.axis]) {
+                // the ray travels towards -axis: the second child is the nearer one
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return hit_anything;
+}
+
+
+// * Packet version of traverse_bvh: the packet walks the tree together, a node is entered by
+// the rays that hit its box, and each child is tested only for the rays that entered its
+// parent. Children are ordered by the direction of the first active ray (packets of camera
+// rays mostly agree). leaf_hit(first, count, lanes) intersects one leaf for the given rays.
+template <typename LeafHit>
+inline void traverse_bvh_packet(const std::vector<linear_bvh_node>& nodes, ray_packet& packet,
+                                uint32_t lanes, LeafHit&& leaf_hit) {
+    if (nodes.empty() || !lanes) return;
 
-        // * general compare function for sorting the objects based on the axis (x, y or z)
-        static bool box_compare(
-            const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
-        ) {
-            // obtain the interval of the objects on the specified axis
-            auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-            auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
+    struct stack_entry { uint32_t node; uint32_t lanes; };
+    stack_entry stack[bvh_builder::max_depth + 48];
+    int stack_size = 0;
+    stack_entry current = { 0, lanes };
 
-            // * compare the minimum coordinate of both objects, return if a is more "ahead" than b
-            return a_axis_interval.min < b_axis_interval.min;
+    while (true) {
+        const linear_bvh_node& node = nodes[current.node];
+        uint32_t active = packet.hit_box(node.bounds_min, node.bounds_max, current.lanes);
+        if (active) {
+            if (node.count > 0) {
+                leaf_hit(node.offset, node.count, active);
+            } else {
+                int first_lane = __builtin_ctz(active);
+                if (packet.inv_direction_f[node.axis][first_lane] < 0) {
+                    stack[stack_size++] = { current.node + 1, active };
+                    current = { node.offset, active };
+                } else {
+                    stack[stack_size++] = { node.offset, active };
+                    current = { current.node + 1, active };
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+}
+
+
+class bvh_node : public hittable { // * define bvh node representation from hittable
+    public:
+        bvh_node(hittable_list list, bvh_split method = bvh_split::sah)
+         : bvh_node(list.objects, 0, list.objects.size(), method) {} // * constructor with hittable list
+
+        bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+                 bvh_split method = bvh_split::sah) {
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            // Collect the boxes of the span of source objects and build the tree over them
+            std::vector<aabb> boxes(end - start);
+            #pragma omp parallel for schedule(static) if (end - start >= bvh_builder::chunk_threshold)
+            for (int64_t i = 0; i < int64_t(end - start); i++)
+                boxes[i] = objects[start + i]->bounding_box();
+
+            bbox = aabb::empty;
+            for (const auto& box : boxes)
+                bbox = aabb(bbox, box);
+
+            bvh_builder builder(boxes, method);
+            nodes = std::move(builder.nodes);
+
+            // * store the objects in leaf order, so every leaf is a contiguous range
+            primitives.reserve(builder.order.size());
+            leaf_objects.reserve(builder.order.size());
+            for (auto index : builder.order) {
+                primitives.push_back(objects[start + index]);
+                leaf_objects.push_back(primitives.back().get());
+            }
+
+            std::chrono::duration<double, std::milli> build_time =
+                std::chrono::high_resolution_clock::now() - build_start;
+            timings.bvh_build_ms += build_time.count();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return traverse_bvh(nodes, r, ray_t, [&](uint32_t first, uint32_t count, interval& t) {
+                // * leaf: closest hit among its objects
+                bool hit_anything = false;
+                for (uint32_t i = first; i < first + count; i++) {
+                    if (leaf_objects[i]->hit(r, t, rec)) {
+                        hit_anything = true;
+                        t.max = rec.t; // only accept closer hits from now on
+                    }
+                }
+                return hit_anything;
+            });
         }
 
-        // specified compare function of X0 Y1 Z2 axis
-        static bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 0);
+        bool occluded(const ray& r, interval ray_t) const override {
+            return traverse_bvh<true>(nodes, r, ray_t, [&](uint32_t first, uint32_t count, interval& t) {
+                for (uint32_t i = first; i < first + count; i++)
+                    if (leaf_objects[i]->occluded(r, t))
+                        return true;
+                return false;
+            });
         }
 
-        static bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 1);
+        void hit_packet(ray_packet& packet, uint32_t lanes) const override {
+            traverse_bvh_packet(nodes, packet, lanes, [&](uint32_t first, uint32_t count, uint32_t active) {
+                for (uint32_t i = first; i < first + count; i++)
+                    leaf_objects[i]->hit_packet(packet, active);
+            });
         }
 
-        static bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 2);
+
+        // * bounding box of the bvh node, return current bounding box
+        aabb bounding_box() const override {
+            return bbox; // return the bounding box
         }
+
+    private:
+        std::vector<linear_bvh_node> nodes; // flattened tree, traversed without recursion
+        std::vector<shared_ptr<hittable>> primitives; // owns the objects, in leaf order
+        std::vector<const hittable*> leaf_objects; // the same objects, as used in traversal
+        aabb bbox; // bounding box of the whole tree
 };
 
-#endif
\ No newline at end of file
+#endif
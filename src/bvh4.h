@@ -0,0 +1,303 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// * node of the 4-wide bvh: the boxes of all four children in SoA layout, so one SIMD slab
+// test covers the whole node. 128 bytes = two cache lines.
+struct alignas(64) bvh4_node {
+    float bounds_min[3][4]; // [axis][child]
+    float bounds_max[3][4];
+    uint32_t child[4];      // interior child: node index, leaf child: first primitive slot
+    uint16_t count[4];      // primitives of a leaf child, 0 for an interior child
+    uint8_t num_children;   // slots [num_children, 4) are unused
+    uint8_t pad[7];
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node must stay two cache lines");
+
+
+// * 4-wide bvh, collapsed from the binary tree of bvh_builder.
+// Every node tests its four child boxes at once against a precomputed inverse direction
+// (AVX: one 4 x double register, SSE2: two 2 x double registers, otherwise a scalar loop).
+// Drop-in replacement for bvh_node; the results are identical.
+class bvh4 : public hittable {
+    public:
+        bvh4(hittable_list list, bvh_split method = bvh_split::sah) {
+            auto build_start = std::chrono::high_resolution_clock::now();
+
+            auto& objects = list.objects;
+            std::vector<aabb> boxes(objects.size());
+            for (size_t i = 0; i < objects.size(); i++)
+                boxes[i] = objects[i]->bounding_box();
+
+            bbox = aabb::empty;
+            for (const auto& box : boxes)
+                bbox = aabb(bbox, box);
+
+            bvh_builder builder(boxes, method);
+
+            primitives.reserve(builder.order.size());
+            leaf_objects.reserve(builder.order.size());
+            for (auto index : builder.order) {
+                primitives.push_back(objects[index]);
+                leaf_objects.push_back(primitives.back().get());
+            }
+
+            if (!builder.nodes.empty())
+                collapse(builder.nodes, 0);
+
+            std::chrono::duration<double, std::milli> build_time =
+                std::chrono::high_resolution_clock::now() - build_start;
+            timings.bvh_build_ms += build_time.count();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            const point3& orig = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z()); // computed once per ray
+
+            struct stack_entry { uint32_t node; double t; };
+            stack_entry stack[3 * (bvh_builder::max_depth + 48) + 4]; // each level adds at most 3
+            int stack_size = 0;
+            stack[stack_size++] = { 0, ray_t.min };
+
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                auto entry = stack[--stack_size];
+                if (entry.t > ray_t.max) continue; // a closer hit was found meanwhile
+
+                const bvh4_node& node = nodes[entry.node];
+                double t_near[4];
+                int mask = intersect(node, orig, inv_dir, ray_t, t_near);
+                if (!mask) continue;
+
+                // * order the hit children front to back
+                int order[4], hits = 0;
+                for (int c = 0; c < node.num_children; c++) {
+                    if (!(mask & (1 << c))) continue;
+                    int k = hits++;
+                    while (k > 0 && t_near[order[k-1]] > t_near[c]) {
+                        order[k] = order[k-1];
+                        k--;
+                    }
+                    order[k] = c;
+                }
+
+                // leaves right away (nearest first), interior children pushed far to near
+                for (int k = 0; k < hits; k++) {
+                    int c = order[k];
+                    if (node.count[c] == 0 || t_near[c] > ray_t.max) continue;
+                    for (uint32_t i = node.child[c]; i < node.child[c] + node.count[c]; i++) {
+                        if (leaf_objects[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t; // only accept closer hits from now on
+                        }
+                    }
+                }
+                for (int k = hits - 1; k >= 0; k--) {
+                    int c = order[k];
+                    if (node.count[c] == 0)
+                        stack[stack_size++] = { node.child[c], t_near[c] };
+                }
+            }
+
+            return hit_anything;
+        }
+
+        // * any-hit version of hit(): children in any order, the first hit ends the search
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            const point3& orig = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+            uint32_t stack[3 * (bvh_builder::max_depth + 48) + 4];
+            int stack_size = 0;
+            stack[stack_size++] = 0;
+
+            while (stack_size > 0) {
+                const bvh4_node& node = nodes[stack[--stack_size]];
+                double t_near[4];
+                int mask = intersect(node, orig, inv_dir, ray_t, t_near);
+                for (int c = 0; c < node.num_children; c++) {
+                    if (!(mask & (1 << c))) continue;
+                    if (node.count[c] == 0) {
+                        stack[stack_size++] = node.child[c];
+                        continue;
+                    }
+                    for (uint32_t i = node.child[c]; i < node.child[c] + node.count[c]; i++)
+                        if (leaf_objects[i]->occluded(r, ray_t))
+                            return true;
+                }
+            }
+            return false;
+        }
+
+        aabb bounding_box() const override {
+            return bbox;
+        }
+
+        size_t node_count() const { return nodes.size(); }
+
+    private:
+        std::vector<bvh4_node> nodes; // the root is nodes[0]
+        std::vector<shared_ptr<hittable>> primitives; // owns the objects, in leaf order
+        std::vector<const hittable*> leaf_objects; // the same objects, as used in traversal
+        aabb bbox;
+
+        // * slab test of the four child boxes; returns a bit mask of the hit children and
+        // * their entry distances. Semantics match linear_bvh_node::hit exactly.
+        static int intersect(const bvh4_node& node, const point3& orig, const vec3& inv_dir,
+                             const interval& ray_t, double t_near[4]) {
+            int valid = (1 << node.num_children) - 1;
+#if defined(__AVX__)
+            __m256d t_min = _mm256_set1_pd(ray_t.min);
+            __m256d t_max = _mm256_set1_pd(ray_t.max);
+            for (int a = 0; a < 3; a++) {
+                __m256d o = _mm256_set1_pd(orig[a]);
+                __m256d inv = _mm256_set1_pd(inv_dir[a]);
+                __m256d lo = _mm256_cvtps_pd(_mm_load_ps(node.bounds_min[a]));
+                __m256d hi = _mm256_cvtps_pd(_mm_load_ps(node.bounds_max[a]));
+                __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(lo, o), inv);
+                __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(hi, o), inv);
+                // order the pair only when t0 > t1, as the scalar swap does (a NaN from 0 * inf
+                // stays in place); max/min then return their second operand on NaN, so a NaN
+                // slab keeps the current interval exactly like the scalar comparisons
+                __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+                __m256d near = _mm256_blendv_pd(t0, t1, swap);
+                __m256d far = _mm256_blendv_pd(t1, t0, swap);
+                t_min = _mm256_max_pd(near, t_min);
+                t_max = _mm256_min_pd(far, t_max);
+            }
+            _mm256_storeu_pd(t_near, t_min);
+            return _mm256_movemask_pd(_mm256_cmp_pd(t_min, t_max, _CMP_LT_OQ)) & valid;
+#elif defined(__SSE2__)
+            int mask = 0;
+            for (int half = 0; half < 2; half++) {
+                __m128d t_min = _mm_set1_pd(ray_t.min);
+                __m128d t_max = _mm_set1_pd(ray_t.max);
+                for (int a = 0; a < 3; a++) {
+                    __m128d o = _mm_set1_pd(orig[a]);
+                    __m128d inv = _mm_set1_pd(inv_dir[a]);
+                    __m128d lo = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(
+                        reinterpret_cast<const __m128i*>(&node.bounds_min[a][2 * half]))));
+                    __m128d hi = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(
+                        reinterpret_cast<const __m128i*>(&node.bounds_max[a][2 * half]))));
+                    __m128d t0 = _mm_mul_pd(_mm_sub_pd(lo, o), inv);
+                    __m128d t1 = _mm_mul_pd(_mm_sub_pd(hi, o), inv);
+                    // same NaN handling as the AVX path (SSE2 has no blend: and/andnot/or)
+                    __m128d swap = _mm_cmpgt_pd(t0, t1);
+                    __m128d near = _mm_or_pd(_mm_and_pd(swap, t1), _mm_andnot_pd(swap, t0));
+                    __m128d far = _mm_or_pd(_mm_and_pd(swap, t0), _mm_andnot_pd(swap, t1));
+                    t_min = _mm_max_pd(near, t_min);
+                    t_max = _mm_min_pd(far, t_max);
+                }
+                _mm_storeu_pd(&t_near[2 * half], t_min);
+                mask |= _mm_movemask_pd(_mm_cmplt_pd(t_min, t_max)) << (2 * half);
+            }
+            return mask & valid;
+#else
+            int mask = 0;
+            for (int c = 0; c < node.num_children; c++) {
+                double t_min = ray_t.min, t_max = ray_t.max;
+                for (int a = 0; a < 3; a++) {
+                    double t0 = (node.bounds_min[a][c] - orig[a]) * inv_dir[a];
+                    double t1 = (node.bounds_max[a][c] - orig[a]) * inv_dir[a];
+                    if (t0 > t1) std::swap(t0, t1);
+                    t_min = t0 > t_min ? t0 : t_min;
+                    t_max = t1 < t_max ? t1 : t_max;
+                }
+                t_near[c] = t_min;
+                if (t_min < t_max) mask |= 1 << c;
+            }
+            return mask;
+#endif
+        }
+
+        static double node_area(const linear_bvh_node& n) {
+            double dx = n.bounds_max[0] - n.bounds_min[0];
+            double dy = n.bounds_max[1] - n.bounds_min[1];
+            double dz = n.bounds_max[2] - n.bounds_min[2];
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        // * Collapse the binary subtree at `index` into one 4-wide node: keep opening the
+        // * largest interior child until there are four children. Returns the new node index.
+        uint32_t collapse(const std::vector<linear_bvh_node>& binary, uint32_t index) {
+            uint32_t kids[4];
+            int num_kids = 0;
+            if (binary[index].count > 0) {
+                kids[num_kids++] = index; // a leaf root becomes the single child of the root
+            } else {
+                kids[num_kids++] = index + 1;
+                kids[num_kids++] = binary[index].offset;
+            }
+
+            while (num_kids < 4) {
+                int best = -1;
+                double best_area = -1;
+                for (int k = 0; k < num_kids; k++) {
+                    const auto& n = binary[kids[k]];
+                    if (n.count == 0 && node_area(n) > best_area) {
+                        best_area = node_area(n);
+                        best = k;
+                    }
+                }
+                if (best < 0) break; // only leaves left
+
+                uint32_t opened = kids[best];
+                kids[best] = opened + 1;
+                kids[num_kids++] = binary[opened].offset;
+            }
+
+            auto node_index = uint32_t(nodes.size());
+            nodes.emplace_back();
+            {
+                bvh4_node& node = nodes[node_index];
+                node.num_children = uint8_t(num_kids);
+                for (int c = 0; c < 4; c++) {
+                    for (int a = 0; a < 3; a++) {
+                        // unused slots are masked out by num_children
+                        node.bounds_min[a][c] = c < num_kids ? binary[kids[c]].bounds_min[a] : 0.0f;
+                        node.bounds_max[a][c] = c < num_kids ? binary[kids[c]].bounds_max[a] : 0.0f;
+                    }
+                    node.child[c] = 0;
+                    node.count[c] = 0;
+                    if (c < num_kids && binary[kids[c]].count > 0) {
+                        node.child[c] = binary[kids[c]].offset;
+                        node.count[c] = binary[kids[c]].count;
+                    }
+                }
+            }
+
+            for (int c = 0; c < num_kids; c++) {
+                if (binary[kids[c]].count == 0) {
+                    uint32_t child_index = collapse(binary, kids[c]);
+                    nodes[node_index].child[c] = child_index; // nodes may have reallocated
+                }
+            }
+
+            return node_index;
+        }
+};
+
+#endif
@@ -4,15 +4,47 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "hittable_list.h"
+#include "light_sampler.h"
 #include "pdf.h"
 #include "material.h"
 #include "vec3.h"
 #include "hdr_texture.h"
+#include "tile_scheduler.h"
+#include "checkpoint.h"
+#include "framebuffer.h"
+#include "denoiser.h"
+#include "aov.h"
+#include "wavefront.h"
+
+#include <atomic>
+#include <chrono>
+#include <numeric>
+#include <string>
+#include <vector>
+
+// * Command line defaults (parsed in main), picked up by every camera a scene creates
+struct camera_defaults {
+    sampler_type sampler = sampler_type::sobol; // random numbers of the camera samples, see sampler.h
+    std::string output_file;     // final image, format from the extension; empty means binary ppm on stdout
+    exr_compression output_compression = exr_compression::zip; // for .exr output
+    bool progressive = false;    // render in passes, see camera::render_progressive
+    double time_limit = 0;       // wall-clock budget in seconds, 0 means none
+    int pass_samples = 4;        // samples per pixel added by each progressive pass
+    std::string progressive_output = "progressive.ppm"; // intermediate image, rewritten after passes
+    int target_samples = 0;      // total spp of a progressive render, 0 means samples_per_pixel
+    std::string checkpoint_file; // progressive state saved here, empty means no checkpoints
+    double checkpoint_interval = 300; // seconds between two checkpoints
+    bool resume = false;         // continue from checkpoint_file if it matches the image
+    bool denoise = false;        // filter the final image guided by first-hit features
+    uint32_t aovs = 0;           // aov_bit()s of the AOVs to write, see aov.h
+    std::string aov_prefix;      // AOV files are <prefix>.<name>.exr; empty: the output file without extension
+    int packet_size = 0;         // camera rays traced together: 4, 8 or 16; 0 traces them one by one
+    bool wavefront = false;      // trace the samples breadth-first, see camera::sample_wavefront
+    light_selection light_sampling = light_selection::power; // choice of the shadow rays' light, see light_sampler.h
+};
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "../ext/stb_image_write.h"
-
-#include <omp.h> // Include OpenMP header for multithreading support
+inline camera_defaults camera_options;
 
 // camera class
 class camera {
@@ -25,8 +57,9 @@ class camera {
         int image_width = 100; // Rendered image width in pixel count
         // * for anti-aliasing
         int samples_per_pixel = 10; // Count of random samples for each pixel
-        // * for recursive ray tracing
-        int max_depth = 10; // Maximum depth of recursive ray tracing
+        // * for path tracing
+        int max_depth = 10; // Maximum number of bounces of a path
+        int russian_roulette_depth = 5; // Bounces before Russian roulette may end a path (>= max_depth disables it)
 
         color background; // Scene background color (if no hdr texture is provided)
         
@@ -40,128 +73,278 @@ class camera {
         double focus_dist = 10; // Distance from camera lookfrom point to plane of perfect focus
 
 
-        void render_mt(const hittable& world, const hittable& lights) {
+        // * adaptive sampling: samples_per_pixel becomes the per-pixel budget, and a pixel stops
+        // * once the standard error of its mean luminance is below adaptive_threshold * mean
+        bool adaptive_sampling = false;
+        int adaptive_min_samples = 16; // samples every pixel gets before its variance is trusted
+        int adaptive_batch = 16;       // samples added between two convergence checks
+        double adaptive_threshold = 0.2; // relative error target (path-traced samples are very noisy)
+
+        // * sampler of every random decision of a camera sample (pixel position, lens, time, light
+        // * and BSDF sampling, Russian roulette). The low-discrepancy samplers take exactly
+        // * samples_per_pixel samples; independent keeps the old sqrt_spp x sqrt_spp jittered grid.
+        sampler_type sampler = camera_options.sampler;
+
+        std::string output_file = camera_options.output_file; // .ppm (P6), .pfm, .png, .exr or .hdr; empty: stdout
+        exr_compression output_compression = camera_options.output_compression;
+
+        // * progressive rendering: passes of pass_samples spp go into a float accumulation buffer
+        // * until samples_per_pixel is reached or time_limit runs out, whichever comes first
+        bool progressive = camera_options.progressive;
+        double time_limit = camera_options.time_limit; // seconds, 0 means no limit
+        int pass_samples = camera_options.pass_samples;
+        std::string progressive_output = camera_options.progressive_output;
+        double progressive_write_interval = 10; // seconds between two intermediate images
+        int target_samples = camera_options.target_samples; // beyond the stratum grid: further rounds
+
+        // * checkpoints of the progressive state (see render_checkpoint), written every
+        // * checkpoint_interval seconds and when the render stops
+        std::string checkpoint_file = camera_options.checkpoint_file;
+        double checkpoint_interval = camera_options.checkpoint_interval;
+        bool resume = camera_options.resume;
+
+        // * denoising of the final image: feature_samples camera rays per pixel record the
+        // * albedo, normal and depth of their first hit (one intersection each, after the render),
+        // * which guide an edge-avoiding a-trous filter (see denoiser.h). Checkpoints and the
+        // * intermediate progressive images stay unfiltered.
+        bool denoise = camera_options.denoise;
+        int feature_samples = 16;
+        denoise_settings denoiser;
+
+        // * AOVs written from the same samples as the image (aov_bit()s, see aov.h). With none
+        // * enabled, ray_color gets no aov_sample and does no extra work.
+        uint32_t aovs = camera_options.aovs;
+        std::string aov_prefix = camera_options.aov_prefix;
+
+        // * packet tracing of camera rays (see ray_packet.h): the same sample of the pixels of a
+        // * 2x2, 4x2 or 4x4 block goes through the bvh as one packet of 4, 8 or 16 rays. Only the
+        // * camera rays are packets, the paths go on one ray at a time from their first hit.
+        // * Adaptive sampling keeps single rays (its pixels stop at different counts).
+        int packet_size = camera_options.packet_size;
+
+        // * wavefront integrator (see wavefront.h): the samples of a tile are traced breadth-first,
+        // * wavefront_size paths at a time, with the hits of each bounce shaded by material kind.
+        // * Gives the same image as depth-first tracing. Adaptive sampling stays depth-first.
+        bool wavefront = camera_options.wavefront;
+        int wavefront_size = 4096;
+
+        // * choice of the light each shadow ray aims at: every render builds a light_sampler
+        // * over the scene's lights with it (see light_sampler.h).
+        light_selection light_sampling = camera_options.light_sampling;
+
+        // * for multi-threaded rendering
+        int tile_size = 16; // Edge length of the square tiles handed out to worker threads
+        int num_threads = 0; // Worker thread count, 0 means one per hardware thread
+
+
+        void render_mt(const hittable& world, const hittable& scene_lights) {
+            if (progressive || time_limit > 0) {
+                render_progressive(world, scene_lights);
+                return;
+            }
             initialize();
+            const light_sampler& lights = sample_lights(world, scene_lights);
+            auto render_start = std::chrono::high_resolution_clock::now();
 
-            // Initialize a 2D array to store the pixel colors
-            auto image = new color*[image_height];
-            for (int i = 0; i < image_height; ++i)
-                image[i] = new color[image_width];
+            // Contiguous buffer to store the pixel colors
+            framebuffer image(image_width, image_height);
+            aov_buffers aov(image_width, image_height, aovs);
 
-            // std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
 
-            // *create a shared variable to track progress
-            int global_done_scanlines = 0;
+            // * work-stealing over tiles: costly regions (glass, smoke) get shared by idle threads
+            tile_scheduler scheduler(num_threads);
+            std::clog << "Rendering " << tiles_x * tiles_y << " tiles of " << tile_size << "x" << tile_size
+                      << " on " << scheduler.size() << " threads\n";
 
+            std::atomic<uint64_t> samples_taken{0};
+            scheduler.run(tiles_x * tiles_y, [&](int tile, int) {
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                int x1 = std::min(x0 + tile_size, image_width);
+                int y1 = std::min(y0 + tile_size, image_height);
 
-            // Parallel rendering using OpenMP
-            // ! Adjust the number of threads to suit your system
-            #pragma omp parallel num_threads(18)
-            {
-                // Set different random seed for each thread
-                srand(int(time(NULL)) ^ omp_get_thread_num());
+                uint64_t tile_samples = 0;
+                render_rect(x0, y0, x1, y1, image, world, lights, tile_samples, aov);
+                samples_taken.fetch_add(tile_samples, std::memory_order_relaxed);
+            });
+            report_samples(samples_taken.load());
 
-                #pragma omp for schedule(static, image_height/(80)) // Use dynamic scheduling for load balancing
-                for (int j = 0; j < image_height; j++) {
-                    #pragma omp critical
-                    {
-                        if ((image_height - global_done_scanlines) % 10 == 0) {
-                            std::clog << "\rScanlines remaining: " << (image_height - global_done_scanlines) << ' ' << std::flush;
-                        }
-                    }
+            // * tonemapped and written on the writer thread
+            writer.write(finish_image(std::move(image), world), output_file, 2.0, output_compression);
+            write_aovs(aov, output_file);
 
-                    #pragma omp atomic
-                    ++global_done_scanlines;
+            record_render_time(render_start);
 
-                    for (int i = 0; i < image_width; i++) {
-                        color pixel_color(0, 0, 0); 
+            std::clog << "\nDone.                 \n";
+        }
 
-                        for (int s_j = 0; s_j < sqrt_spp; s_j++) {
-                            for (int s_i = 0; s_i < sqrt_spp; s_i++) {
-                                ray r = get_ray(i, j, s_i, s_j);
-                                pixel_color += ray_color(r, max_depth, world, lights);
-                            }
 
-                            image[j][i] = pixel_color * pixel_samples_scale;
-                        }
-                    }
-                }
+        void render(const hittable& world, const hittable& scene_lights) {
+            if (progressive || time_limit > 0) {
+                render_progressive(world, scene_lights);
+                return;
             }
-            
+            initialize();
+            const light_sampler& lights = sample_lights(world, scene_lights);
+            auto render_start = std::chrono::high_resolution_clock::now();
 
-            // Output the stored pixel colors
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-            for (int j = 0; j < image_height; ++j) {
-                for (int i = 0; i < image_width; ++i) {
-                    write_color(std::cout, image[j][i]);
-                }
+            framebuffer image(image_width, image_height);
+            aov_buffers aov(image_width, image_height, aovs);
+
+            uint64_t samples_taken = 0;
+            for (int j = 0; j < image_height; j += block_height) {
+                // print the progress
+                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
+                // means of the samples, one band of blocks at a time
+                render_rect(0, j, image_width, std::min(j + block_height, image_height), image, world, lights,
+                            samples_taken, aov);
             }
+            report_samples(samples_taken);
+
+            writer.write(finish_image(std::move(image), world), output_file, 2.0, output_compression);
+            write_aovs(aov, output_file);
 
-            // Clean up memory
-            for (int i = 0; i < image_height; ++i)
-                delete[] image[i];
-            delete[] image;
+            record_render_time(render_start);
 
             std::clog << "\nDone.                 \n";
         }
 
-
-        void render(const hittable& world, const hittable& lights) {
+        // * Progressive rendering on all cores: every pass adds pass_samples samples to each pixel
+        // * (continuing its stratum sequence, so the full run matches a normal render), and the
+        // * current average is written to progressive_output every progressive_write_interval
+        // * seconds. A pass that would not finish within time_limit is not started.
+        // * With resume set, a matching checkpoint_file is loaded first and its samples are kept;
+        // * the render continues with the stratum grid and sampler they were drawn with.
+        void render_progressive(const hittable& world, const hittable& scene_lights) {
             initialize();
+            const light_sampler& lights = sample_lights(world, scene_lights);
+            auto render_start = std::chrono::high_resolution_clock::now();
+            auto seconds_since = [](std::chrono::high_resolution_clock::time_point t) {
+                return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t).count();
+            };
+
+            const int target = target_samples > 0 ? target_samples : pixel_samples;
+            const int per_pass = std::max(1, pass_samples);
+
+            render_checkpoint state;
+            if (resume && !checkpoint_file.empty() && state.load(checkpoint_file)) {
+                if (state.width == uint32_t(image_width) && state.height == uint32_t(image_height)) {
+                    set_strata(int(state.sqrt_spp)); // keep drawing from the grid the samples came from
+                    if (state.sampler != sampler)
+                        std::clog << "Resuming with the checkpoint's sampler, not the one asked for\n";
+                    sampler = state.sampler;         // and from the same sequences
+                    std::clog << "Resuming from " << checkpoint_file << " at " << state.min_samples() << " spp\n";
+                } else {
+                    std::clog << "Ignoring " << checkpoint_file << ": it is " << state.width << 'x'
+                              << state.height << ", the image is " << image_width << 'x' << image_height << "\n";
+                    state.reset(image_width, image_height, sqrt_spp, sampler);
+                }
+            } else {
+                if (resume)
+                    std::clog << "No checkpoint to resume from, starting over\n";
+                state.reset(image_width, image_height, sqrt_spp, sampler);
+            }
 
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            // AOVs cover the samples of this run (a resumed render's earlier samples are only in the sums)
+            aov_buffers aov(image_width, image_height, aovs);
+
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            tile_scheduler scheduler(num_threads);
+            std::clog << "Progressive rendering: " << per_pass << " spp per pass, up to " << target << " spp";
+            if (time_limit > 0) std::clog << " or " << time_limit << " s";
+            std::clog << ", " << scheduler.size() << " threads\n";
+
+            int samples_done = int(state.min_samples());
+            double last_pass_seconds = 0, last_write = 0, last_checkpoint = 0;
+            while (samples_done < target) {
+                double elapsed = seconds_since(render_start);
+                if (time_limit > 0 && last_pass_seconds > 0 && elapsed + last_pass_seconds > time_limit)
+                    break; // the next pass would overrun the budget
+
+                auto pass_start = std::chrono::high_resolution_clock::now();
+
+                scheduler.run(tiles_x * tiles_y, [&](int tile, int) {
+                    int x0 = (tile % tiles_x) * tile_size;
+                    int y0 = (tile / tiles_x) * tile_size;
+                    int x1 = std::min(x0 + tile_size, image_width);
+                    int y1 = std::min(y0 + tile_size, image_height);
+
+                    const int count = (x1 - x0) * (y1 - y0);
+                    std::vector<int> first(count), last(count);
+                    std::vector<color> sums(count);
+                    for (int j = y0, b = 0; j < y1; j++) {
+                        for (int i = x0; i < x1; i++, b++) {
+                            first[b] = int(state.samples[size_t(j) * image_width + i]);
+                            last[b] = std::min(first[b] + per_pass, target);
+                        }
+                    }
 
-            for (int j = 0; j < image_height; j++) {
-                // print the progress
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0, 0, 0); // initialize the pixel color as black
-
-                    // * stratified sampling
-                    for (int s_j = 0; s_j < sqrt_spp; s_j++) { // stratified sampling in y direction
-                        for (int s_i = 0; s_i < sqrt_spp; s_i++) { // stratified sampling in x direction
-                            // generate a ray through the pixel with random offset with stratified sampling
-                            ray r = get_ray(i, j, s_i, s_j);
-                            pixel_color += ray_color(r, max_depth, world, lights); // calculate & accumulate the color
-                            }
+                    sample_rect(x0, y0, x1, y1, first.data(), last.data(), sums.data(), world, lights, aov);
+
+                    for (int j = y0, b = 0; j < y1; j++) {
+                        for (int i = x0; i < x1; i++, b++) {
+                            if (first[b] >= last[b]) continue;
+                            size_t p = size_t(j) * image_width + i;
+                            state.sum[3*p]   += float(sums[b].x());
+                            state.sum[3*p+1] += float(sums[b].y());
+                            state.sum[3*p+2] += float(sums[b].z());
+                            state.samples[p] = uint32_t(last[b]);
                         }
-                    
-                    // scale the accumulated color and output to the output stream
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
+                    }
+                }, "");
+
+                samples_done = int(state.min_samples());
+                last_pass_seconds = seconds_since(pass_start);
+                elapsed = seconds_since(render_start);
+                std::clog << "\rPass done: " << samples_done << " spp in " << elapsed << " s      " << std::flush;
+
+                if (elapsed - last_write >= progressive_write_interval && samples_done < target) {
+                    writer.write(average_image(state), progressive_output, 2.0, output_compression);
+                    last_write = elapsed;
+                }
+                if (!checkpoint_file.empty() && elapsed - last_checkpoint >= checkpoint_interval
+                    && samples_done < target) {
+                    save_checkpoint(state);
+                    last_checkpoint = elapsed;
                 }
             }
 
-            std::clog << "\nDone.                 \n";
+            std::clog << "\nStopped at " << samples_done << " of " << target << " spp\n";
+            writer.write(average_image(state), progressive_output, 2.0, output_compression);
+            if (!checkpoint_file.empty())
+                save_checkpoint(state); // lets a later run top the image up
+
+            writer.write(finish_image(average_image(state), world), output_file, 2.0, output_compression);
+            write_aovs(aov, output_file);
+
+            record_render_time(render_start);
+
+            std::clog << "Done.                 \n";
         }
 
-        void render_png(const hittable& world, const hittable& lights, const std::string& output_filename, double gamma_value) {
+        void render_png(const hittable& world, const hittable& scene_lights, const std::string& output_filename, double gamma_value) {
             initialize();
+            const light_sampler& lights = sample_lights(world, scene_lights);
+            auto render_start = std::chrono::high_resolution_clock::now();
 
-            // Create an array to store pixel colors
-            unsigned char* image_data = new unsigned char[image_width * image_height * 3];
+            framebuffer image(image_width, image_height);
+            aov_buffers aov(image_width, image_height, aovs);
 
-            for (int j = 0; j < image_height; j++) {
+            uint64_t samples_taken = 0;
+            for (int j = 0; j < image_height; j += block_height) {
                 std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0, 0, 0); // initialize the pixel color as black
-
-                    // Stratified sampling
-                    for (int s_j = 0; s_j < sqrt_spp; s_j++) {
-                        for (int s_i = 0; s_i < sqrt_spp; s_i++) {
-                            ray r = get_ray(i, j, s_i, s_j);
-                            pixel_color += ray_color(r, max_depth, world, lights);
-                        }
-                    }
-
-                    write_color_png(image_data, 3 * (j * image_width + i), pixel_samples_scale * pixel_color, samples_per_pixel, gamma_value);
-                }
+                render_rect(0, j, image_width, std::min(j + block_height, image_height), image, world, lights,
+                            samples_taken, aov);
             }
+            report_samples(samples_taken);
 
-            // Use stb_image_write to write the image to a PNG file
-            stbi_write_png(output_filename.c_str(), image_width, image_height, 3, image_data, image_width * 3);
+            writer.write(finish_image(std::move(image), world), output_filename, gamma_value);
+            write_aovs(aov, output_filename);
 
-            // Clean up the allocated memory
-            delete[] image_data;
+            record_render_time(render_start);
 
             std::clog << "\nDone.\n";
         }
@@ -169,10 +352,19 @@ class camera {
 
     private:
         int    image_height;   // Rendered image height
-        double pixel_samples_scale; // Color scale factor for a sum of pixel samples
+        int    pixel_samples;  // samples of a (non-adaptive) pixel: samples_per_pixel or the grid size
 
         int sqrt_spp; // Square root of number of samples per pixel
         double recip_sqrt_spp; // 1 / sqrt_spp
+        int stratum_stride;    // adaptive order of the strata: k-th sample uses stratum k * stride mod spp
+
+        int packet_lanes;      // packet_size rounded down to 4, 8 or 16; 0: single rays
+        int block_width;       // pixel blocks sharing packets (1x1 without packets)
+        int block_height;
+
+        image_writer writer;   // writes finished images in the background
+
+        shared_ptr<light_sampler> light_set; // the lights of the current render, see sample_lights
 
         point3 center;         // Camera center
         point3 pixel00_loc;    // Location of pixel 0, 0
@@ -182,15 +374,434 @@ class camera {
         vec3 defocus_disk_u;   // Defocus disk horizontal radius
         vec3 defocus_disk_v;   // Defocus disk vertical radius
 
+        // * means of the pixels of [x0, x1) x [y0, y1) into image; adds the number of samples
+        // * taken to sample_count
+        void render_rect(int x0, int y0, int x1, int y1, framebuffer& image, const hittable& world,
+                         const light_sampler& lights, uint64_t& sample_count, aov_buffers& aov) const {
+            if (adaptive_sampling || (packet_lanes == 0 && !wavefront)) {
+                for (int j = y0; j < y1; j++)
+                    for (int i = x0; i < x1; i++)
+                        image.set(i, j, sample_pixel(i, j, world, lights, sample_count, aov));
+                return;
+            }
+
+            const int count = (x1 - x0) * (y1 - y0);
+            std::vector<int> first(count, 0), last(count, pixel_samples);
+            std::vector<color> sums(count);
+            sample_rect(x0, y0, x1, y1, first.data(), last.data(), sums.data(), world, lights, aov);
+            for (int j = y0, b = 0; j < y1; j++)
+                for (int i = x0; i < x1; i++, b++)
+                    image.set(i, j, sums[b] / pixel_samples);
+            sample_count += uint64_t(count) * pixel_samples;
+        }
+
+        // * sums of the samples [first[b], last[b]) of the pixels b of [x0, x1) x [y0, y1)
+        // * (row-major): breadth-first with wavefront, else block by block (see sample_block)
+        void sample_rect(int x0, int y0, int x1, int y1, const int* first, const int* last, color* sums,
+                         const hittable& world, const light_sampler& lights, aov_buffers& aov) const {
+            if (wavefront) {
+                sample_wavefront(x0, y0, x1, y1, first, last, sums, world, lights, aov);
+                return;
+            }
+
+            const int width = x1 - x0;
+            int block_first[ray_packet::max_size], block_last[ray_packet::max_size];
+            color block_sums[ray_packet::max_size];
+            for (int by = y0; by < y1; by += block_height) {
+                for (int bx = x0; bx < x1; bx += block_width) {
+                    int bx1 = std::min(bx + block_width, x1), by1 = std::min(by + block_height, y1);
+                    for (int j = by, b = 0; j < by1; j++) {
+                        for (int i = bx; i < bx1; i++, b++) {
+                            block_first[b] = first[(j - y0) * width + (i - x0)];
+                            block_last[b] = last[(j - y0) * width + (i - x0)];
+                        }
+                    }
+                    sample_block(bx, by, bx1, by1, block_first, block_last, block_sums, world, lights, aov);
+                    for (int j = by, b = 0; j < by1; j++)
+                        for (int i = bx; i < bx1; i++, b++)
+                            sums[(j - y0) * width + (i - x0)] = block_sums[b];
+                }
+            }
+        }
+
+        // * Wavefront version of sample_rect (see wavefront.h): the samples of the rectangle go
+        // * through the stages wavefront_size paths at a time, pixel after pixel. Sums are added up
+        // * in sample order once a batch is done, as sample_range would.
+        void sample_wavefront(int x0, int y0, int x1, int y1, const int* first, const int* last, color* sums,
+                              const hittable& world, const light_sampler& lights, aov_buffers& aov) const {
+            const int width = x1 - x0, count = width * (y1 - y0);
+            const bool with_aov = aov.any();
+            static thread_local wavefront_batch batch;
+            batch.reserve(wavefront_size, with_aov);
+            uint64_t allocations_before = thread_allocations;
+
+            for (int b = 0; b < count; b++)
+                sums[b] = color(0, 0, 0);
+
+            int b = 0, k = count > 0 ? first[0] : 0; // next (pixel, sample) to start
+            while (b < count) {
+                // * generate: camera rays of the next samples
+                int size = 0;
+                while (b < count && size < wavefront_size) {
+                    if (k >= last[b]) {
+                        if (++b < count) k = first[b];
+                        continue;
+                    }
+                    batch.pixel[size] = b;
+                    batch.paths[size].start(sample_ray(x0 + b % width, y0 + b / width, k),
+                                            with_aov ? &batch.aov[size] : nullptr);
+                    batch.rng[size] = thread_rng;
+                    size++;
+                    k++;
+                }
+
+                trace_batch(batch, size, world, lights);
+
+                for (int s = 0; s < size; s++) {
+                    int pixel = batch.pixel[s];
+                    sums[pixel] += batch.paths[s].radiance;
+                    if (with_aov)
+                        aov.add(size_t(y0 + pixel / width) * image_width + x0 + pixel % width, batch.aov[s]);
+                }
+            }
+
+            if (uint64_t allocations = thread_allocations - allocations_before)
+                path_allocations.fetch_add(allocations, std::memory_order_relaxed);
+        }
+
+        // * all bounces of the first `size` paths of batch, stage by stage
+        void trace_batch(wavefront_batch& batch, int size, const hittable& world, const light_sampler& lights) const {
+            batch.live.clear();
+            for (int s = 0; s < size; s++)
+                batch.live.push_back(s);
+
+            for (int bounce = 1; bounce <= max_depth && !batch.live.empty(); bounce++) {
+                // * intersect (camera rays in packets when enabled: consecutive slots are
+                // * samples of the same or neighbouring pixels)
+                const int live_count = int(batch.live.size());
+                const int lanes = bounce == 1 ? packet_lanes : 0;
+                for (int first_live = 0; first_live < live_count; first_live += std::max(lanes, 1)) {
+                    if (lanes == 0) {
+                        int s = batch.live[first_live];
+                        thread_rng = batch.rng[s];
+                        rng_start_bounce(bounce);
+                        batch.hit_anything[s] = world.hit(batch.paths[s].r, interval(0.001, infinity), batch.hits[s]);
+                        batch.rng[s] = thread_rng;
+                        continue;
+                    }
+
+                    int n = std::min(lanes, live_count - first_live);
+                    ray rays[ray_packet::max_size];
+                    for (int l = 0; l < n; l++)
+                        rays[l] = batch.paths[batch.live[first_live + l]].r;
+                    ray_packet packet(rays, n, interval(0.001, infinity));
+                    world.hit_packet(packet, packet.lanes());
+                    for (int l = 0; l < n; l++) {
+                        int s = batch.live[first_live + l];
+                        thread_rng = batch.rng[s];
+                        rng_start_bounce(bounce);
+                        packet_record(packet, l, rays[l], world, batch.hits[s]);
+                        batch.hit_anything[s] = batch.hits[s].mat != nullptr;
+                        batch.rng[s] = thread_rng;
+                    }
+                }
+
+                // * sort, then shade group by group
+                batch.sort_by_material();
+                for (int g = 0; g < live_count; g++) {
+                    int s = batch.sorted[g];
+                    thread_rng = batch.rng[s];
+                    const hit_record* hit = batch.hit_anything[s] ? &batch.hits[s] : nullptr;
+                    batch.alive[s] = shade_vertex(batch.paths[s], bounce, hit, world, lights);
+                    batch.rng[s] = thread_rng;
+                }
+
+                // * compact: the paths that go on, in slot order
+                batch.next_live.clear();
+                for (int s : batch.live)
+                    if (batch.alive[s]) batch.next_live.push_back(s);
+                batch.live.swap(batch.next_live);
+            }
+        }
+
+        // * sums of the samples [first[b], last[b]) of the pixels b of the block [x0, x1) x [y0, y1)
+        // * (row-major, at most ray_packet::max_size pixels). With packets, the camera rays of one
+        // * sample index go out together; each path then continues on its own from its first hit.
+        void sample_block(int x0, int y0, int x1, int y1, const int* first, const int* last, color* sums,
+                          const hittable& world, const light_sampler& lights, aov_buffers& aov) const {
+            const int width = x1 - x0, count = width * (y1 - y0);
+            if (packet_lanes == 0) {
+                for (int b = 0; b < count; b++)
+                    sums[b] = first[b] < last[b]
+                            ? sample_range(x0 + b % width, y0 + b / width, first[b], last[b], world, lights, aov)
+                            : color(0, 0, 0);
+                return;
+            }
+
+            uint64_t allocations_before = thread_allocations;
+            aov_sample aov_values;
+            aov_sample* sample_aov = aov.any() ? &aov_values : nullptr;
+
+            int k_begin = first[0], k_end = last[0];
+            for (int b = 0; b < count; b++) {
+                sums[b] = color(0, 0, 0);
+                k_begin = std::min(k_begin, first[b]);
+                k_end = std::max(k_end, last[b]);
+            }
+
+            for (int k = k_begin; k < k_end; k++) {
+                ray rays[ray_packet::max_size];
+                int lane_pixel[ray_packet::max_size];
+                int lanes = 0;
+                for (int b = 0; b < count; b++) {
+                    if (k < first[b] || k >= last[b]) continue;
+                    lane_pixel[lanes] = b;
+                    rays[lanes++] = sample_ray(x0 + b % width, y0 + b / width, k);
+                }
+                if (lanes == 0) continue;
+
+                ray_packet packet(rays, lanes, interval(0.001, infinity));
+                world.hit_packet(packet, packet.lanes());
+
+                for (int l = 0; l < lanes; l++) {
+                    int b = lane_pixel[l];
+                    int i = x0 + b % width, j = y0 + b / width;
+                    // back to the lane's own random numbers: volumes draw some in hit()
+                    start_sample(i, j, k);
+                    rng_start_bounce(1);
+                    hit_record rec;
+                    packet_record(packet, l, rays[l], world, rec);
+                    sums[b] += ray_color(rays[l], world, lights, sample_aov, &rec);
+                    if (sample_aov) aov.add(size_t(j) * image_width + i, aov_values);
+                }
+            }
+
+            if (uint64_t allocations = thread_allocations - allocations_before)
+                path_allocations.fetch_add(allocations, std::memory_order_relaxed);
+        }
+
+        // * hit record of packet lane l, from the hit() of the object that recorded it; a full
+        // * trace if that fails (float and double tests may disagree by an ulp) or the lane asks
+        // * for one, mat == nullptr for a miss
+        static void packet_record(const ray_packet& packet, int l, const ray& r, const hittable& world,
+                                  hit_record& rec) {
+            rec.mat = nullptr;
+            const hittable* object = packet.closest[l];
+            if (packet.retrace[l] || (object && !object->hit(r, packet.hit_interval(l), rec)))
+                world.hit(r, interval(packet.t_min, infinity), rec);
+        }
+
+        // * mean of the samples of pixel (i, j); adds the number taken to sample_count and every
+        // * sample's AOVs to aov
+        color sample_pixel(int i, int j, const hittable& world, const light_sampler& lights,
+                           uint64_t& sample_count, aov_buffers& aov) const {
+            uint64_t allocations_before = thread_allocations;
+            color pixel_color(0, 0, 0);
+            int samples = 0;
+            const size_t pixel = size_t(j) * image_width + i;
+            aov_sample aov_values;
+            aov_sample* sample_aov = aov.any() ? &aov_values : nullptr;
+
+            if (!adaptive_sampling) {
+                for (; samples < pixel_samples; samples++) {
+                    pixel_color += ray_color(sample_ray(i, j, samples), world, lights, sample_aov);
+                    if (sample_aov) aov.add(pixel, aov_values);
+                }
+            } else {
+                // * Welford running mean / M2 of the luminance, checked after every batch
+                int budget = pixel_samples;
+                double mean = 0, m2 = 0;
+                int check_at = std::min(std::max(adaptive_min_samples, 2), budget);
+                bool passed_once = false;
+
+                while (samples < budget) {
+                    // any prefix of a pixel's samples covers the whole pixel (see sample_ray)
+                    color sample = ray_color(sample_ray(i, j, samples), world, lights, sample_aov);
+                    pixel_color += sample;
+                    if (sample_aov) aov.add(pixel, aov_values);
+
+                    samples++;
+                    double y = luminance(sample);
+                    double delta = y - mean;
+                    mean += delta / samples;
+                    m2 += delta * (y - mean);
+
+                    if (samples == check_at) {
+                        // * a few samples easily miss rare bright paths and look converged, so a
+                        // * pixel has to pass two checks in a row before it stops
+                        double standard_error = std::sqrt(m2 / (double(samples) * (samples - 1)));
+                        bool passed = standard_error <= adaptive_threshold * mean;
+                        if (passed && passed_once)
+                            break;
+                        passed_once = passed;
+                        check_at = std::min(samples + std::max(adaptive_batch, 1), budget);
+                    }
+                }
+            }
+
+            // the tracing loop should not allocate at all, so the shared counter stays untouched
+            if (uint64_t allocations = thread_allocations - allocations_before)
+                path_allocations.fetch_add(allocations, std::memory_order_relaxed);
+
+            sample_count += samples;
+            return pixel_color / samples;
+        }
+
+        // * sum of the samples [first, last) of pixel (i, j); their AOVs go to aov
+        color sample_range(int i, int j, int first, int last, const hittable& world,
+                           const light_sampler& lights, aov_buffers& aov) const {
+            uint64_t allocations_before = thread_allocations;
+            color sum(0, 0, 0);
+            const size_t pixel = size_t(j) * image_width + i;
+            aov_sample aov_values;
+            aov_sample* sample_aov = aov.any() ? &aov_values : nullptr;
+
+            for (int k = first; k < last; k++) {
+                sum += ray_color(sample_ray(i, j, k), world, lights, sample_aov);
+                if (sample_aov) aov.add(pixel, aov_values);
+            }
+
+            if (uint64_t allocations = thread_allocations - allocations_before)
+                path_allocations.fetch_add(allocations, std::memory_order_relaxed);
+            return sum;
+        }
+
+        // * current average of every pixel, for the image writer
+        framebuffer average_image(const render_checkpoint& state) const {
+            framebuffer image(image_width, image_height);
+            for (size_t p = 0; p < state.samples.size(); p++)
+                image.set(p, average(state, p));
+            return image;
+        }
+
+        static color average(const render_checkpoint& state, size_t p) {
+            if (state.samples[p] == 0) return color(0, 0, 0);
+            return color(state.sum[3*p], state.sum[3*p+1], state.sum[3*p+2]) / state.samples[p];
+        }
+
+        // * the rendered image as it is written: denoised if enabled, otherwise unchanged
+        framebuffer finish_image(framebuffer image, const hittable& world) const {
+            if (!denoise) return image;
+            auto denoise_start = std::chrono::high_resolution_clock::now();
+            framebuffer filtered = ::denoise(image, record_features(world), denoiser);
+            std::chrono::duration<double, std::milli> denoise_time =
+                std::chrono::high_resolution_clock::now() - denoise_start;
+            std::clog << "\rDenoised in " << denoise_time.count() << " ms      \n";
+            return filtered;
+        }
+
+        // * mean first-hit albedo, normal and depth of feature_samples camera rays per pixel,
+        // * drawn like the first samples of the render (same pixel positions, lens and time)
+        feature_buffers record_features(const hittable& world) const {
+            feature_buffers features(image_width, image_height);
+            const int samples = std::max(1, feature_samples);
+
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            tile_scheduler scheduler(num_threads);
+            scheduler.run(tiles_x * tiles_y, [&](int tile, int) {
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                int x1 = std::min(x0 + tile_size, image_width);
+                int y1 = std::min(y0 + tile_size, image_height);
+
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) {
+                        color albedo(0, 0, 0);
+                        vec3 normal(0, 0, 0);
+                        double depth = 0;
+                        for (int k = 0; k < samples; k++) {
+                            ray r = sample_ray(i, j, k);
+                            rng_start_bounce(1);
+                            hit_record rec;
+                            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                                albedo += background_color(r);
+                                continue;
+                            }
+                            scatter_record srec;
+                            albedo += rec.mat->scatter(r, rec, srec)
+                                    ? srec.attenuation
+                                    : rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
+                            normal += rec.normal;
+                            depth += rec.t * r.direction().length();
+                        }
+                        size_t p = size_t(j) * image_width + i;
+                        features.albedo.set(p, albedo / samples);
+                        features.normal.set(p, normal / samples);
+                        features.depth[p] = float(depth / samples);
+                    }
+                }
+            }, "Feature tiles");
+            return features;
+        }
+
+        // * every enabled AOV to <aov_prefix>.<name>.exr (see aov_prefix), one after the other on
+        // * the writer thread
+        void write_aovs(const aov_buffers& aov, const std::string& image_path) {
+            std::string prefix = aov_prefix;
+            if (prefix.empty()) {
+                prefix = image_path.empty() ? "render" : image_path;
+                size_t dot = prefix.find_last_of('.');
+                if (dot != std::string::npos && prefix.find_last_of("/\\") + 1 <= dot)
+                    prefix.erase(dot);
+            }
+            for (int k = 0; k < aov_type_count; k++) {
+                aov_type type = aov_type(k);
+                if (aov.enabled(type))
+                    writer.write(aov.resolve(type), prefix + "." + aov_name(type) + ".exr", 2.0, output_compression);
+            }
+        }
+
+        void save_checkpoint(const render_checkpoint& state) const {
+            if (!state.save(checkpoint_file))
+                std::clog << "\nCannot write checkpoint " << checkpoint_file << "\n";
+        }
+
+        void report_samples(uint64_t samples_taken) const {
+            if (!adaptive_sampling) return;
+            double average = double(samples_taken) / (double(image_width) * image_height);
+            std::clog << "\rAdaptive sampling: " << average << " samples per pixel on average (budget "
+                      << pixel_samples << ")\n";
+        }
+
+        static void record_render_time(std::chrono::high_resolution_clock::time_point render_start) {
+            std::chrono::duration<double, std::milli> render_time =
+                std::chrono::high_resolution_clock::now() - render_start;
+            timings.render_ms += render_time.count();
+        }
+
+        // * stratum grid of sqrt_samples x sqrt_samples cells per pixel
+        void set_strata(int sqrt_samples) {
+            sqrt_spp = sqrt_samples;
+            recip_sqrt_spp = 1.0 / sqrt_spp; // calculate the reciprocal of the square root of samples per pixel
+
+            // golden-ratio stride through the strata, made coprime with their count so it visits each once
+            int strata = sqrt_spp * sqrt_spp;
+            stratum_stride = std::max(1, int(strata * 0.6180339887498949));
+            while (std::gcd(stratum_stride, strata) != 1)
+                stratum_stride++;
+        }
+
+        // * the lights the shadow rays aim at, each resolved to the world's emitter where it is
+        const light_sampler& sample_lights(const hittable& world, const hittable& scene_lights) {
+            light_set = make_shared<light_sampler>(scene_lights, world, light_sampling);
+            auto list = dynamic_cast<const hittable_list*>(&scene_lights);
+            if (list && light_set->size() != list->objects.size())
+                std::clog << "Sampling " << light_set->size() << " of " << list->objects.size() << " lights\n";
+            return *light_set;
+        }
+
         void initialize() {
             // calculate the height of the image, ensure that it is at least 1.
             image_height = int(image_width / aspect_ratio);
             image_height = (image_height < 1) ? 1 : image_height;
 
-            sqrt_spp = int(std::sqrt(samples_per_pixel)); // calculate the square root of samples per pixel
-            // pixel_samples_scale = 1.0 / samples_per_pixel;
-            pixel_samples_scale = 1.0 / (sqrt_spp * sqrt_spp); // calculate the scale factor for pixel samples
-            recip_sqrt_spp = 1.0 / sqrt_spp; // calculate the reciprocal of the square root of samples per pixel
+            set_strata(int(std::sqrt(samples_per_pixel))); // calculate the square root of samples per pixel
+            pixel_samples = sampler == sampler_type::independent ? sqrt_spp * sqrt_spp : std::max(1, samples_per_pixel);
+
+            packet_lanes = packet_size >= 16 ? 16 : packet_size >= 8 ? 8 : packet_size >= 4 ? 4 : 0;
+            block_width = packet_lanes >= 8 ? 4 : packet_lanes == 4 ? 2 : 1;
+            block_height = packet_lanes == 0 ? 1 : packet_lanes / block_width;
 
             center = lookfrom; // Camera center is the lookfrom point
 
@@ -230,13 +841,36 @@ class camera {
         }
         
 
+        // * k-th camera ray of pixel (i, j), with the sampler set to that sample.
+        // * Independent: the strata of the sqrt_spp grid in a scattered order (k * stratum_stride),
+        // * so any prefix covers the whole pixel; samples past the grid start further rounds, each
+        // * seeded apart from the rounds before. Halton / Sobol: sample k of the pixel's sequence,
+        // * whose first two dimensions place the ray in the pixel.
+        ray sample_ray(int i, int j, int k) const {
+            int stratum = start_sample(i, j, k);
+            if (sampler == sampler_type::independent)
+                return get_ray(i, j, sample_square_stratified(stratum % sqrt_spp, stratum / sqrt_spp));
+            return get_ray(i, j, sample_square());
+        }
+
+        // * point the sampler at sample k of pixel (i, j); returns the stratum (independent sampler)
+        int start_sample(int i, int j, int k) const {
+            size_t pixel = size_t(j) * image_width + i;
+            if (sampler == sampler_type::independent) {
+                int strata = sqrt_spp * sqrt_spp;
+                int stratum = int(int64_t(k) * stratum_stride % strata);
+                rng_start_sample(pixel, uint64_t(k / strata) * strata + stratum);
+                return stratum;
+            }
+            rng_start_sample(pixel, uint64_t(k), sampler);
+            return 0;
+        }
+
         // * for anti-aliasing
-        ray get_ray(int i, int j, int s_i, int s_j) const {
+        ray get_ray(int i, int j, const vec3& offset) const {
             // * with defocus feature
-            // * Construct a camera ray originating from the defocus disk and directed at a randomly
-            // * // sampled point around the pixel location i, j for stratified sample square s_i, s_j
-            // auto offset = sample_square(); // generate a random offset for offsetting the ray for AA
-            auto offset = sample_square_stratified(s_i, s_j); // generate a stratified random offset for offsetting the ray for AA
+            // * Construct a camera ray originating from the defocus disk and directed at the point
+            // * offset from the center of pixel i, j
             auto pixel_sample = pixel00_loc
                                 + ((i + offset.x()) * pixel_delta_u)
                                 + ((j + offset.y()) * pixel_delta_v);
@@ -267,7 +901,9 @@ class camera {
         // ? sample_disk() depends on the function random_in_unit_disk() which is defined later on.)
         vec3 sample_square() const {
             // * Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-            return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+            double px, py;
+            random_double_2d(px, py);
+            return vec3(px - 0.5, py - 0.5, 0);
         }
 
 
@@ -277,59 +913,154 @@ class camera {
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        color ray_color(const ray& r, int depth, const hittable& world, const hittable& lights
-        ) const {
-            // * If we've exceeded the ray bounce limit, no more light is gathered.
-            if (depth <= 0)
-                return color(0, 0, 0);
-
-            hit_record rec;
+        // * radiance arriving along a ray that leaves the scene
+        color background_color(const ray& r) const {
+            if (background_texture) {
+                vec3 unit_direction = unit_vector(r.direction());
+                double u = 0.5 + atan2(unit_direction.z(), unit_direction.x()) / (2 * pi);
+                double v = 0.5 - asin(unit_direction.y()) / pi;
+                return background_texture->value(u, v);  // 使用 HDR 环境贴图
+            }
+            return background; // 使用背景颜色
+        }
 
-            // If the ray doesn't hit anything, return the background color.
-            if (!world.hit(r, interval(0.001, infinity), rec)){
-                if (background_texture) {
-                    vec3 unit_direction = unit_vector(r.direction());
-                    double u = 0.5 + atan2(unit_direction.z(), unit_direction.x()) / (2 * pi);
-                    double v = 0.5 - asin(unit_direction.y()) / pi;
-                    return background_texture->value(u, v);  // 使用 HDR 环境贴图
+        // * iterative path tracer: follows one path and carries its throughput (the product of
+        // * attenuation * pdf weights so far) instead of recursing once per bounce.
+        // * aov, if given, receives the first-hit AOVs and the radiance split by bounce.
+        // * primary, if given, is the camera ray's hit found beforehand (mat == nullptr: a miss),
+        // * with the random stream left where that search left it.
+        color ray_color(const ray& camera_ray, const hittable& world, const light_sampler& lights,
+                        aov_sample* aov = nullptr, const hit_record* primary = nullptr) const {
+            path_state path;
+            path.start(camera_ray, aov);
+
+            for (int bounce = 1; bounce <= max_depth; bounce++) {
+                // every path vertex draws from its own block of random dimensions (a primary hit
+                // was found in the stream of bounce 1 already, see sample_block)
+                if (bounce > 1 || !primary) rng_start_bounce(bounce);
+
+                hit_record rec;
+                bool hit_anything;
+                if (bounce == 1 && primary) {
+                    rec = *primary;
+                    hit_anything = rec.mat != nullptr;
                 } else {
-                    return background; // 使用背景颜色
+                    hit_anything = world.hit(path.r, interval(0.001, infinity), rec);
                 }
-            }
-
-            scatter_record srec;
-            // ray scattered;
-            // color attenuation;
-            // double pdf_value;
-            // Calculate the color emitted by the material at the hit point.
-            color color_from_emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
-
-            // If the material doesn't scatter the ray, return the emitted color.
-            if (!rec.mat->scatter(r, rec, srec))
-                return color_from_emission;
 
-            if (srec.skip_pdf) {
-                return srec.attenuation * ray_color(srec.skip_pdf_ray, depth-1, world, lights);
+                if (!shade_vertex(path, bounce, hit_anything ? &rec : nullptr, world, lights))
+                    break;
             }
 
-            auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-            mixture_pdf p(light_ptr, srec.pdf_ptr);
+            return path.radiance;
+        }
 
-            ray scattered = ray(rec.p, p.generate(), r.time());
-            auto pdf_value = p.value(scattered.direction());
+        // * One vertex of a path: adds the light reaching the camera from where path.r ended
+        // * (hit, nullptr if it left the scene) and replaces path.r by the ray scattered there.
+        // * Returns false when the path ends. Draws from the current random stream, which must be
+        // * the path's own at this bounce.
+        // * Direct light comes from two strategies combined with the power heuristic: a shadow
+        // * ray towards a point sampled on `lights` (next-event estimation), and the material's
+        // * own scattered ray when it happens to hit an emitter. Delta lobes (metal, glass:
+        // * skip_pdf) cannot be reached by a shadow ray, so what their ray hits counts fully.
+        bool shade_vertex(path_state& path, int bounce, const hit_record* hit, const hittable& world,
+                          const light_sampler& lights) const {
+            const ray& r = path.r;
+            color& throughput = path.throughput;
+            aov_sample* aov = path.aov;
+
+            // light reaching the camera from path vertex `vertex`: emission, direct or indirect
+            auto add_radiance = [&](const color& light, int vertex) {
+                path.radiance += light;
+                if (aov) (vertex == 1 ? aov->emission : vertex == 2 ? aov->direct : aov->indirect) += light;
+            };
+
+            // If the ray doesn't hit anything, add the background and stop.
+            if (!hit) {
+                color background_light = background_color(r);
+                if (aov && bounce == 1) aov->albedo = background_light;
+                add_radiance(throughput * background_light, bounce);
+                return false;
+            }
+            const hit_record& rec = *hit;
+
+            // Add the light emitted by the material at the hit point, weighted against the
+            // shadow ray of the last vertex when that one could have found it too.
+            color emitted = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
+            if (emitted.x() > 0 || emitted.y() > 0 || emitted.z() > 0) {
+                double weight = 1;
+                if (path.bsdf_pdf > 0)
+                    weight = power_heuristic(path.bsdf_pdf, lights.pdf_at(r.origin(), r.direction(), rec.t));
+                add_radiance(throughput * emitted * weight, bounce);
+            }
 
-            double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+            // If the material doesn't scatter the ray, the path ends here.
+            scatter_record srec;
+            bool scattered_ray = rec.mat->scatter(r, rec, srec);
+            if (aov && bounce == 1) {
+                aov->depth = rec.t * r.direction().length();
+                aov->normal = rec.normal;
+                aov->albedo = scattered_ray ? srec.attenuation : emitted;
+                aov->primitive_id = rec.primitive_id;
+                aov->material_id = rec.mat->material_id;
+            }
+            // the last vertex scatters nothing: its shadow ray would see light from one vertex
+            // further than any material-sampled path may reach, and break the MIS balance
+            if (!scattered_ray || bounce == max_depth)
+                return false;
 
-            color sample_color = ray_color(scattered, depth-1, world, lights);
+            if (srec.skip_pdf) {
+                throughput = throughput * srec.attenuation;
+                path.r = srec.skip_pdf_ray;
+                path.bsdf_pdf = 0;
+            } else {
+                // * the pdfs live on the stack: no heap allocation per bounce
+                const pdf& material_pdf = *srec.pdf_ptr();
+
+                // * next-event estimation: one shadow ray towards a point on the lights, whose
+                // * emission the sampler already knows. It only has to reach the point unblocked
+                // * (an any-hit query), stopping just short of the light's own surface.
+                light_sample ls;
+                if (lights.sample(rec.p, ls)) {
+                    ray shadow(rec.p, ls.direction, r.time());
+                    double scattering_pdf = rec.mat->scattering_pdf(r, rec, shadow);
+                    if (scattering_pdf > 0
+                        && !world.occluded(shadow, interval(0.001, (1 - light_sampler::point_tolerance) * ls.t))) {
+                        double weight = power_heuristic(ls.pdf, material_pdf.value(ls.direction));
+                        add_radiance(throughput * srec.attenuation * ls.emission * (scattering_pdf * weight / ls.pdf),
+                                     bounce + 1);
+                    }
+                }
 
-            // * Compute the color from the scattered ray, multiply by the attenuation and the PDF
-            // * The result is divided by the PDF to correctly normalize the color contribution
-            color color_from_scatter = 
-                (srec.attenuation * scattering_pdf * sample_color) / pdf_value;
+                // * continue the path along a direction sampled from the material
+                ray scattered = ray(rec.p, material_pdf.generate(), r.time());
+                double pdf_value = material_pdf.value(scattered.direction());
+                double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+                if (!(pdf_value > 0))
+                    return false;
+
+                // * the scattered ray's contribution is weighted by attenuation * BRDF pdf / sampling pdf
+                throughput = throughput * srec.attenuation * (scattering_pdf / pdf_value);
+                path.r = scattered;
+                path.bsdf_pdf = pdf_value;
+            }
 
-            // Return the sum of the emitted color and the scattered color.
-            return color_from_emission + color_from_scatter;
-    }
+            // * a path that can no longer contribute ends right away
+            double survival = std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z()));
+            if (!(survival > 0))
+                return false;
+
+            // * Russian roulette: end dim paths at random, and boost the survivors so the
+            // * estimate stays unbiased. Survival never drops below 1/2, so a survivor is
+            // * at most doubled (boosting dim paths further mostly adds fireflies).
+            if (bounce >= russian_roulette_depth) {
+                survival = std::fmin(std::fmax(survival, 0.5), 0.95);
+                if (random_double() >= survival)
+                    return false;
+                throughput /= survival;
+            }
+            return true;
+        }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,107 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sampler.h"
+
+// * State of a progressive render that can be saved and resumed: per-pixel sums of all samples
+// so far (float rgb) and per-pixel sample counts.
+// The RNG is counter based (see rng_start_sample), so the next sample of a pixel is fully
+// determined by its count: the counts double as RNG positions, and a resumed render continues
+// every pixel with exactly the samples an uninterrupted one would have taken.
+//
+// The counts are RNG positions only within the sampler that drew them, so the sampler type is
+// saved along with the stratum grid.
+//
+// File layout (native byte order, 28-byte header):
+//   char magic[8] = "RTWCKPT", uint32 version, uint32 width, uint32 height, uint32 sqrt_spp,
+//   uint32 sampler (sampler_type),
+//   then float sum[width * height * 3], uint32 samples[width * height], row-major from the top.
+struct render_checkpoint {
+    static constexpr char magic[8] = "RTWCKPT";
+    static constexpr uint32_t version = 2;
+    static constexpr uint32_t max_sqrt_spp = 46340; // the camera's strata count sqrt_spp^2 fits an int
+
+    uint32_t width = 0, height = 0;
+    uint32_t sqrt_spp = 0;         // edge of the stratum grid the samples were drawn from
+    sampler_type sampler = sampler_type::sobol; // sampler the samples were drawn with
+    std::vector<float> sum;        // rgb sum of the samples of each pixel
+    std::vector<uint32_t> samples; // samples taken so far in each pixel
+
+    void reset(int image_width, int image_height, int grid, sampler_type drawn_with) {
+        width = uint32_t(image_width);
+        height = uint32_t(image_height);
+        sqrt_spp = uint32_t(grid);
+        sampler = drawn_with;
+        sum.assign(size_t(width) * height * 3, 0.0f);
+        samples.assign(size_t(width) * height, 0);
+    }
+
+    // * fewest samples of any pixel
+    uint32_t min_samples() const {
+        uint32_t fewest = UINT32_MAX;
+        for (auto n : samples) fewest = n < fewest ? n : fewest;
+        return samples.empty() ? 0 : fewest;
+    }
+
+    // * write to a temporary file first and rename it, so a job killed while saving
+    // * keeps the previous checkpoint
+    bool save(const std::string& path) const {
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out) return false;
+            uint32_t header[5] = { version, width, height, sqrt_spp, uint32_t(sampler) };
+            out.write(magic, sizeof(magic));
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(sum.data()), std::streamsize(sum.size() * sizeof(float)));
+            out.write(reinterpret_cast<const char*>(samples.data()),
+                      std::streamsize(samples.size() * sizeof(uint32_t)));
+            if (!out) return false;
+        }
+        return std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+    // * false (leaving *this unchanged) if the file is missing, truncated or not a checkpoint.
+    // * The header is checked against the file's length before anything is allocated, so a
+    // * corrupt one cannot ask for an image the file does not hold.
+    bool load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return false;
+        auto file_size = uint64_t(std::streamoff(in.tellg()));
+        in.seekg(0);
+
+        char file_magic[8];
+        uint32_t header[5];
+        in.read(file_magic, sizeof(file_magic));
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!in || std::memcmp(file_magic, magic, sizeof(magic)) != 0 || header[0] != version)
+            return false;
+
+        constexpr uint64_t header_size = sizeof(magic) + sizeof(header);
+        constexpr uint64_t pixel_size = 3 * sizeof(float) + sizeof(uint32_t);
+        uint64_t pixels = uint64_t(header[1]) * header[2]; // < 2^64: no overflow
+        if (pixels == 0 || file_size - header_size != pixels * pixel_size
+            || (file_size - header_size) / pixel_size != pixels
+            || header[3] == 0 || header[3] > max_sqrt_spp || header[4] > uint32_t(sampler_type::sobol))
+            return false;
+
+        render_checkpoint loaded;
+        loaded.reset(int(header[1]), int(header[2]), int(header[3]), sampler_type(header[4]));
+        in.read(reinterpret_cast<char*>(loaded.sum.data()), std::streamsize(loaded.sum.size() * sizeof(float)));
+        in.read(reinterpret_cast<char*>(loaded.samples.data()),
+                std::streamsize(loaded.samples.size() * sizeof(uint32_t)));
+        if (!in) return false;
+
+        *this = std::move(loaded);
+        return true;
+    }
+};
+
+#endif
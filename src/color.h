@@ -1,4 +1,4 @@
-#ifndef CLOROR_H
+#ifndef COLOR_H
 #define COLOR_H
 
 #include "interval.h"
@@ -10,6 +10,11 @@
 
 using color = vec3;
 
+// * relative luminance (Rec. 709 weights)
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 // * gamma correction (gamma 2)
 inline double linear_to_gamma(double linear_component) {
     if (linear_component > 0)
@@ -56,20 +61,6 @@ void write_color(std::ostream& out, const color& pixel_color) {
 }
 
 
-void write_color_png(unsigned char* pixel_data, int index, color pixel_color, int samples_per_pixel, double gamma) {
-    // Apply adjustable gamma correction for each color component
-    auto scale = 1.0 / samples_per_pixel;
-    auto r = pow(pixel_color.x() * scale, 1.0 / gamma);
-    auto g = pow(pixel_color.y() * scale, 1.0 / gamma);
-    auto b = pow(pixel_color.z() * scale, 1.0 / gamma);
-
-    // Clamp and convert to byte
-    pixel_data[index] = static_cast<int>(256 * std::clamp(r, 0.0, 0.999));
-    pixel_data[index + 1] = static_cast<int>(256 * std::clamp(g, 0.0, 0.999));
-    pixel_data[index + 2] = static_cast<int>(256 * std::clamp(b, 0.0, 0.999));
-}
-
-
 
 
 #endif
\ No newline at end of file
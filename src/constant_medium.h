@@ -60,11 +60,28 @@ class constant_medium : public hittable {
 
         rec.normal = vec3(1,0,0);  // The normal vector is arbitrary as the volume has no explicit surface
         rec.front_face = true;     // The front face is also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
+        rec.primitive_id = object_id;
 
         return true;
     }
 
+    // Packet test: the scattering distance is random, and the one drawn here could not be drawn
+    // again when the hit record is filled in. Lanes entering the volume before their closest
+    // hit are traced again as single rays instead; closer surfaces still win in the packet.
+    void hit_packet(ray_packet& packet, uint32_t lanes) const override {
+        for (int l = 0; l < packet.size; l++) {
+            if (!(lanes & (1u << l))) continue;
+            ray r = packet.lane_ray(l);
+            hit_record rec1, rec2;
+            if (!boundary->hit(r, interval::universe, rec1)
+                || !boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
+                continue;
+            if (rec2.t > packet.t_min && rec1.t < packet.t_max[l])
+                packet.record_retrace(l, std::fmax(rec1.t, packet.t_min));
+        }
+    }
+
     // Bounding box function: Returns the bounding box of the volume
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
@@ -0,0 +1,225 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// * First-hit features of every pixel, averaged over a few camera rays per pixel. They are
+// * noise-free (or nearly so) after a handful of samples and tell the denoiser where the edges are.
+struct feature_buffers {
+    framebuffer albedo;       // reflectance of the first surface; emission of lights, background of misses
+    framebuffer normal;       // world-space shading normal facing the camera, zero for misses
+    std::vector<float> depth; // distance to the first hit, 0 for misses
+
+    feature_buffers() = default;
+    feature_buffers(int width, int height)
+        : albedo(width, height), normal(width, height), depth(size_t(width) * height, 0.0f) {}
+};
+
+struct denoise_settings {
+    int iterations = 5;          // a-trous levels: the filter reaches 2^(iterations+1) + 1 pixels across
+    float sigma_color = 4.0f;    // luminance edge-stopping, in standard deviations of the pixel noise
+    float sigma_normal = 128.0f; // exponent of the normal similarity (higher keeps creases sharper)
+    float sigma_depth = 1.0f;    // depth edge-stopping, relative to the local depth gradient
+    float sigma_albedo = 0.1f;   // albedo edge-stopping (keeps lights and dark materials apart)
+};
+
+
+// * Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance-guided colour
+// * weight of SVGF (Schied et al. 2017), on a single frame:
+//   - the colour is divided by the albedo first, so textures stay sharp and only the (smooth)
+//     illumination is filtered; the result is multiplied back at the end,
+//   - every level is a 5x5 B3-spline kernel with holes 2^level pixels apart, whose taps are
+//     weighted down across normal, depth and albedo discontinuities and across luminance
+//     differences that are large compared to the pixel's noise,
+//   - the noise is estimated from the luminance variance among neighbours on the same surface,
+//     and filtered along with the colour,
+//   - luminances are compared after a 3x3 blur: single-pixel outliers (rare bright paths) then
+//     still spread into their neighbours instead of being cut off, which would darken the image.
+// Rows run in parallel with OpenMP.
+inline framebuffer denoise(const framebuffer& noisy, const feature_buffers& features,
+                           const denoise_settings& settings = {}) {
+    const int width = noisy.width, height = noisy.height;
+    const size_t n = noisy.pixel_count();
+    const float* albedo = features.albedo.rgb.data();
+    const float* depth = features.depth.data();
+
+    // * demodulate: divide by the albedo where there is one to divide by
+    std::vector<float> modulation(3 * n), current(3 * n), next(3 * n);
+    for (size_t k = 0; k < 3 * n; k++) {
+        modulation[k] = albedo[k] > 1e-3f ? albedo[k] : 1.0f;
+        float c = noisy.rgb[k];
+        current[k] = (c == c ? c : 0.0f) / modulation[k]; // NaN samples become 0, as in the writers
+    }
+
+    // * unit normals, and per pixel the smaller one-sided depth difference in x and y (the
+    // * smaller side does not reach across a silhouette)
+    std::vector<float> normal(3 * n), depth_dx(n), depth_dy(n);
+    for (size_t p = 0; p < n; p++) {
+        const float* m = &features.normal.rgb[3 * p];
+        float length = std::sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+        float scale = length > 0 ? 1.0f / length : 0.0f;
+        for (int c = 0; c < 3; c++) normal[3 * p + c] = m[c] * scale;
+    }
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            size_t p = size_t(j) * width + i;
+            float left = i > 0 ? std::fabs(depth[p] - depth[p - 1]) : INFINITY;
+            float right = i + 1 < width ? std::fabs(depth[p + 1] - depth[p]) : INFINITY;
+            float up = j > 0 ? std::fabs(depth[p] - depth[p - width]) : INFINITY;
+            float down = j + 1 < height ? std::fabs(depth[p + width] - depth[p]) : INFINITY;
+            depth_dx[p] = std::isfinite(std::min(left, right)) ? std::min(left, right) : 0.0f;
+            depth_dy[p] = std::isfinite(std::min(up, down)) ? std::min(up, down) : 0.0f;
+        }
+    }
+
+    auto luminance_at = [](const std::vector<float>& rgb, size_t p) {
+        return 0.2126f * rgb[3 * p] + 0.7152f * rgb[3 * p + 1] + 0.0722f * rgb[3 * p + 2];
+    };
+
+    // * geometric dissimilarity of pixels p and q, (di, dj) apart, from normals, depth and
+    // * albedo: the weight is exp(-distance), so the three factors cost a single exp
+    auto geometry_distance = [&](size_t p, size_t q, int di, int dj) {
+        const float* np = &normal[3 * p];
+        const float* nq = &normal[3 * q];
+        bool miss_p = np[0] == 0 && np[1] == 0 && np[2] == 0;
+        bool miss_q = nq[0] == 0 && nq[1] == 0 && nq[2] == 0;
+        if (miss_p || miss_q) return miss_p == miss_q ? 0.0f : INFINITY;
+
+        float cosine = np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2];
+        if (!(cosine > 0)) return INFINITY;
+        float distance = -settings.sigma_normal * std::log(std::min(cosine, 1.0f)); // cosine^sigma_normal
+
+        float expected = depth_dx[p] * std::abs(di) + depth_dy[p] * std::abs(dj); // along the surface
+        float tolerance = settings.sigma_depth * expected + 1e-3f * depth[p] + 1e-6f;
+        distance += std::fabs(depth[p] - depth[q]) / tolerance;
+
+        float albedo_distance = 0;
+        for (int c = 0; c < 3; c++) {
+            float d = albedo[3 * p + c] - albedo[3 * q + c];
+            albedo_distance += d * d;
+        }
+        return distance + albedo_distance / (settings.sigma_albedo * settings.sigma_albedo);
+    };
+
+    // * the 3x3 neighbourhood weights (binomial kernel times geometry) are the same on every
+    // * level, so they are computed once; 0 outside the image
+    std::vector<float> surface_weight(9 * n);
+    #pragma omp parallel for schedule(static)
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            size_t p = size_t(j) * width + i;
+            for (int dj = -1; dj <= 1; dj++) {
+                for (int di = -1; di <= 1; di++) {
+                    int x = i + di, y = j + dj;
+                    float& w = surface_weight[9 * p + 3 * (dj + 1) + (di + 1)];
+                    w = 0;
+                    if (x < 0 || x >= width || y < 0 || y >= height) continue;
+                    w = (di == 0 ? 0.5f : 0.25f) * (dj == 0 ? 0.5f : 0.25f);
+                    if (di != 0 || dj != 0)
+                        w *= std::exp(-geometry_distance(p, size_t(y) * width + x, di, dj));
+                }
+            }
+        }
+    }
+
+    // * initial noise: luminance variance over the 5x5 neighbours on the same surface
+    std::vector<float> variance(n), variance_next(n), variance_blurred(n), luminance_blurred(n);
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            size_t p = size_t(j) * width + i;
+            float weight_sum = 0, mean = 0, mean_square = 0;
+            for (int dj = -2; dj <= 2; dj++) {
+                for (int di = -2; di <= 2; di++) {
+                    int x = i + di, y = j + dj;
+                    if (x < 0 || x >= width || y < 0 || y >= height) continue;
+                    size_t q = size_t(y) * width + x;
+                    float w = std::exp(-geometry_distance(p, q, di, dj));
+                    float l = luminance_at(current, q);
+                    weight_sum += w;
+                    mean += w * l;
+                    mean_square += w * l * l;
+                }
+            }
+            mean /= weight_sum; // weight_sum >= 1: p itself
+            variance[p] = std::max(0.0f, mean_square / weight_sum - mean * mean);
+        }
+    }
+
+    static constexpr float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f }; // B3 spline, by |offset|
+
+    for (int level = 0; level < settings.iterations; level++) {
+        const int step = 1 << level;
+
+        // the luminance and the variance steering the colour weight are blurred 3x3 first
+        // (the luminance only over the same surface), both are noisy themselves
+        #pragma omp parallel for schedule(static)
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                size_t p = size_t(j) * width + i;
+                float sum = 0, weight_sum = 0, luminance_sum = 0, luminance_weight = 0;
+                for (int dj = -1; dj <= 1; dj++) {
+                    for (int di = -1; di <= 1; di++) {
+                        int x = i + di, y = j + dj;
+                        if (x < 0 || x >= width || y < 0 || y >= height) continue;
+                        size_t q = size_t(y) * width + x;
+                        float w = (di == 0 ? 0.5f : 0.25f) * (dj == 0 ? 0.5f : 0.25f);
+                        sum += w * variance[q];
+                        weight_sum += w;
+                        float w_surface = surface_weight[9 * p + 3 * (dj + 1) + (di + 1)];
+                        luminance_sum += w_surface * luminance_at(current, q);
+                        luminance_weight += w_surface;
+                    }
+                }
+                variance_blurred[p] = sum / weight_sum;
+                luminance_blurred[p] = luminance_sum / luminance_weight;
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 4)
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                size_t p = size_t(j) * width + i;
+                float lp = luminance_blurred[p];
+                float color_tolerance = settings.sigma_color * std::sqrt(variance_blurred[p]) + 1e-4f;
+
+                float sum[3] = { 0, 0, 0 }, weight_sum = 0, variance_sum = 0;
+                for (int kj = -2; kj <= 2; kj++) {
+                    for (int ki = -2; ki <= 2; ki++) {
+                        int di = ki * step, dj = kj * step;
+                        int x = i + di, y = j + dj;
+                        if (x < 0 || x >= width || y < 0 || y >= height) continue;
+                        size_t q = size_t(y) * width + x;
+
+                        float w = kernel[std::abs(ki)] * kernel[std::abs(kj)];
+                        if (q != p) {
+                            float distance = geometry_distance(p, q, di, dj)
+                                           + std::fabs(lp - luminance_blurred[q]) / color_tolerance;
+                            w *= std::exp(-distance);
+                        }
+                        for (int c = 0; c < 3; c++) sum[c] += w * current[3 * q + c];
+                        weight_sum += w;
+                        variance_sum += w * w * variance[q];
+                    }
+                }
+                for (int c = 0; c < 3; c++) next[3 * p + c] = sum[c] / weight_sum;
+                variance_next[p] = variance_sum / (weight_sum * weight_sum);
+            }
+        }
+        current.swap(next);
+        variance.swap(variance_next);
+    }
+
+    // * remodulate
+    framebuffer result(width, height);
+    for (size_t k = 0; k < 3 * n; k++)
+        result.rgb[k] = current[k] * modulation[k];
+    return result;
+}
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef EXR_H
+#define EXR_H
+
+#include "../ext/stb_image_write.h"
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+// stb_image_write's zlib compressor (the one behind its PNG writer); its header section does
+// not declare it
+STBIWDEF unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+
+// * float -> IEEE half, rounding to nearest even; overflow becomes infinity, NaN stays NaN
+inline uint16_t float_to_half(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, 4);
+    uint32_t sign = (f >> 16) & 0x8000;
+    uint32_t magnitude = f & 0x7fffffff;
+
+    if (magnitude >= 0x7f800000) // inf or NaN (keeping a quiet NaN bit)
+        return uint16_t(sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0));
+    if (magnitude >= 0x477ff000) // rounds to above 65504
+        return uint16_t(sign | 0x7c00);
+    if (magnitude < 0x38800000) { // half denormal (or zero): align the mantissa to 2^-24 steps
+        if (magnitude < 0x33000000) return uint16_t(sign); // below half the smallest denormal
+        uint32_t shift = 126 - (magnitude >> 23); // 14..24
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return uint16_t(sign | half);
+    }
+    // normal: rebias the exponent and round the 13 dropped mantissa bits
+    uint32_t half = (magnitude - 0x38000000) >> 13;
+    uint32_t rest = magnitude & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return uint16_t(sign | half);
+}
+
+// * Convert n floats to halves, NaN -> 0 (like write_color). F16C does 8 per instruction;
+// rows are spread over the OpenMP threads.
+inline void floats_to_halves(const float* in, uint16_t* out, size_t n, size_t row_length) {
+    const int64_t rows = int64_t((n + row_length - 1) / row_length);
+    #pragma omp parallel for schedule(static) if (n >= (size_t(1) << 16))
+    for (int64_t row = 0; row < rows; row++) {
+        size_t k = size_t(row) * row_length;
+        size_t end = std::min(k + row_length, n);
+#if defined(__F16C__)
+        for (; k + 8 <= end; k += 8) {
+            __m256 x = _mm256_loadu_ps(in + k);
+            x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q)); // NaN lanes -> 0
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + k), _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT));
+        }
+#endif
+        for (; k < end; k++)
+            out[k] = in[k] == in[k] ? float_to_half(in[k]) : 0;
+    }
+}
+
+
+// * compression methods of the scanline EXR subset written here (values as in the file)
+enum class exr_compression : uint8_t { none = 0, rle = 1, zip = 3 };
+
+namespace exr_detail {
+
+    inline void put_u32(std::vector<char>& out, uint32_t v) {
+        for (int b = 0; b < 4; b++) out.push_back(char((v >> (8 * b)) & 0xff));
+    }
+
+    inline void put_float(std::vector<char>& out, float f) {
+        uint32_t v;
+        std::memcpy(&v, &f, 4);
+        put_u32(out, v);
+    }
+
+    inline void put_string(std::vector<char>& out, const char* s) {
+        out.insert(out.end(), s, s + std::strlen(s) + 1);
+    }
+
+    // attribute header: name, type, value size; the caller appends the value
+    inline void put_attribute(std::vector<char>& out, const char* name, const char* type, uint32_t size) {
+        put_string(out, name);
+        put_string(out, type);
+        put_u32(out, size);
+    }
+
+    // * the byte shuffle and delta predictor that both RLE and ZIP apply before compressing:
+    // * even bytes first, then odd bytes, then each byte replaced by its difference to the previous
+    inline void predict(const std::vector<uint8_t>& raw, std::vector<uint8_t>& out) {
+        size_t n = raw.size();
+        out.resize(n);
+        size_t half = (n + 1) / 2;
+        for (size_t k = 0; k < n; k++)
+            out[(k & 1) ? half + k / 2 : k / 2] = raw[k];
+        for (size_t k = n - 1; k > 0; k--)
+            out[k] = uint8_t(int(out[k]) - int(out[k - 1]) + 128);
+    }
+
+    // * OpenEXR's run-length code: a run of 3..128 equal bytes is (length - 1, byte), anything
+    // * else is a literal block of -length followed by up to 127 bytes
+    inline void rle_encode(const std::vector<uint8_t>& in, std::vector<uint8_t>& out) {
+        out.clear();
+        size_t n = in.size(), run_start = 0, run_end = 1;
+        while (run_start < n) {
+            while (run_end < n && in[run_start] == in[run_end] && run_end - run_start - 1 < 127)
+                run_end++;
+            if (run_end - run_start >= 3) {
+                out.push_back(uint8_t(run_end - run_start - 1));
+                out.push_back(in[run_start]);
+                run_start = run_end;
+            } else {
+                while (run_end < n
+                       && (run_end + 1 >= n || in[run_end] != in[run_end + 1]
+                           || run_end + 2 >= n || in[run_end + 1] != in[run_end + 2])
+                       && run_end - run_start < 127)
+                    run_end++;
+                out.push_back(uint8_t(-int(run_end - run_start)));
+                out.insert(out.end(), in.begin() + run_start, in.begin() + run_end);
+                run_start = run_end;
+            }
+            run_end++;
+        }
+    }
+
+}
+
+
+// * Write a scanline OpenEXR file of half-float R, G, B channels.
+// rgb: width * height interleaved floats, rows from the top. Chunks are 1 scanline (none,
+// RLE) or 16 scanlines (ZIP) and are converted and compressed in parallel; a chunk that would
+// not shrink is stored uncompressed, as the format allows.
+inline bool write_exr(std::ostream& out, int width, int height, const float* rgb,
+                      exr_compression compression = exr_compression::zip) {
+    using namespace exr_detail;
+    if (width <= 0 || height <= 0) return false;
+
+    std::vector<uint16_t> halves(size_t(width) * height * 3);
+    floats_to_halves(rgb, halves.data(), halves.size(), size_t(width) * 3);
+
+    // * header
+    std::vector<char> header = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 }; // magic, version 2 (scanline)
+
+    put_attribute(header, "channels", "chlist", 3 * 18 + 1);
+    for (const char* channel : { "B", "G", "R" }) { // channels are stored in alphabetical order
+        put_string(header, channel);
+        put_u32(header, 1);  // pixel type HALF
+        put_u32(header, 0);  // pLinear + 3 reserved bytes
+        put_u32(header, 1);  // x sampling
+        put_u32(header, 1);  // y sampling
+    }
+    header.push_back(0);
+
+    put_attribute(header, "compression", "compression", 1);
+    header.push_back(char(compression));
+    for (const char* window : { "dataWindow", "displayWindow" }) {
+        put_attribute(header, window, "box2i", 16);
+        put_u32(header, 0);
+        put_u32(header, 0);
+        put_u32(header, uint32_t(width - 1));
+        put_u32(header, uint32_t(height - 1));
+    }
+    put_attribute(header, "lineOrder", "lineOrder", 1);
+    header.push_back(0); // increasing y
+    put_attribute(header, "pixelAspectRatio", "float", 4);
+    put_float(header, 1.0f);
+    put_attribute(header, "screenWindowCenter", "v2f", 8);
+    put_float(header, 0.0f);
+    put_float(header, 0.0f);
+    put_attribute(header, "screenWindowWidth", "float", 4);
+    put_float(header, 1.0f);
+    header.push_back(0); // end of header
+
+    // * chunks: per scanline the B, G and R planes of the row
+    const int lines_per_chunk = compression == exr_compression::zip ? 16 : 1;
+    const int chunk_count = (height + lines_per_chunk - 1) / lines_per_chunk;
+    std::vector<std::vector<uint8_t>> chunks(chunk_count);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < chunk_count; c++) {
+        int y0 = c * lines_per_chunk, y1 = std::min(y0 + lines_per_chunk, height);
+        std::vector<uint8_t> raw(size_t(y1 - y0) * width * 3 * 2);
+        uint8_t* dst = raw.data();
+        for (int y = y0; y < y1; y++) {
+            const uint16_t* row = &halves[size_t(y) * width * 3];
+            for (int channel = 2; channel >= 0; channel--) { // B, G, R
+                for (int x = 0; x < width; x++) {
+                    uint16_t h = row[3 * x + channel];
+                    *dst++ = uint8_t(h & 0xff);
+                    *dst++ = uint8_t(h >> 8);
+                }
+            }
+        }
+
+        std::vector<uint8_t> packed;
+        if (compression != exr_compression::none) {
+            std::vector<uint8_t> predicted;
+            predict(raw, predicted);
+            if (compression == exr_compression::rle) {
+                rle_encode(predicted, packed);
+            } else {
+                int packed_size = 0;
+                unsigned char* z = stbi_zlib_compress(predicted.data(), int(predicted.size()), &packed_size, 8);
+                if (z) {
+                    packed.assign(z, z + packed_size);
+                    std::free(z);
+                }
+            }
+        }
+        chunks[c] = !packed.empty() && packed.size() < raw.size() ? std::move(packed) : std::move(raw);
+    }
+
+    // * offset table, then the chunks (y, size, data)
+    uint64_t offset = header.size() + 8 * uint64_t(chunk_count);
+    std::vector<char> table;
+    for (int c = 0; c < chunk_count; c++) {
+        put_u32(table, uint32_t(offset));
+        put_u32(table, uint32_t(offset >> 32));
+        offset += 8 + chunks[c].size();
+    }
+
+    out.write(header.data(), std::streamsize(header.size()));
+    out.write(table.data(), std::streamsize(table.size()));
+    for (int c = 0; c < chunk_count; c++) {
+        std::vector<char> prefix;
+        put_u32(prefix, uint32_t(c * lines_per_chunk));
+        put_u32(prefix, uint32_t(chunks[c].size()));
+        out.write(prefix.data(), 8);
+        out.write(reinterpret_cast<const char*>(chunks[c].data()), std::streamsize(chunks[c].size()));
+    }
+    return bool(out);
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "color.h"
+#include "exr.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../ext/stb_image_write.h"
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// * contiguous linear float RGB image, rows from the top
+struct framebuffer {
+    int width = 0, height = 0;
+    std::vector<float> rgb; // 3 floats per pixel
+
+    framebuffer() = default;
+    framebuffer(int width, int height) : width(width), height(height), rgb(size_t(width) * height * 3, 0.0f) {}
+
+    size_t pixel_count() const { return size_t(width) * height; }
+
+    void set(size_t p, const color& c) {
+        rgb[3*p]   = float(c.x());
+        rgb[3*p+1] = float(c.y());
+        rgb[3*p+2] = float(c.z());
+    }
+
+    void set(int i, int j, const color& c) { set(size_t(j) * width + i, c); }
+};
+
+
+// * 8-bit tonemapped (ppm, png) or linear HDR (pfm, exr, hdr)
+enum class image_format { ppm, pfm, png, exr, hdr };
+
+// * format from the file extension; binary ppm for anything unknown (and for stdout)
+inline image_format format_from_path(const std::string& path) {
+    auto ends_with = [&](const char* ext) {
+        std::string e(ext);
+        return path.size() >= e.size() && path.compare(path.size() - e.size(), e.size(), e) == 0;
+    };
+    if (ends_with(".png")) return image_format::png;
+    if (ends_with(".pfm")) return image_format::pfm;
+    if (ends_with(".exr")) return image_format::exr;
+    if (ends_with(".hdr")) return image_format::hdr;
+    return image_format::ppm;
+}
+
+
+// * Tonemap the whole buffer to 8-bit in one pass: NaN -> 0, gamma, clamp to [0, 0.999], * 256.
+// Gamma 2 (the default, same bytes as write_color) is a square root: 8 components per step
+// with AVX, 4 with SSE2 (std::sqrt itself does not vectorize because of errno).
+// Other gammas go through pow.
+inline void tonemap_to_bytes(const framebuffer& image, std::vector<uint8_t>& bytes, double gamma = 2.0) {
+    const size_t n = image.rgb.size();
+    bytes.resize(n);
+    const float* in = image.rgb.data();
+    uint8_t* out = bytes.data();
+
+    if (gamma == 2.0) {
+        size_t k = 0;
+#if defined(__AVX__)
+        const __m256 zero = _mm256_setzero_ps(), top = _mm256_set1_ps(0.999f), scale = _mm256_set1_ps(256.0f);
+        for (; k + 8 <= n; k += 8) {
+            // max returns its second operand on NaN, so NaN becomes 0
+            __m256 x = _mm256_max_ps(_mm256_loadu_ps(in + k), zero);
+            __m256 g = _mm256_min_ps(_mm256_sqrt_ps(x), top);
+            __m256i v = _mm256_cvttps_epi32(_mm256_mul_ps(g, scale));
+            __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extractf128_si256(v, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + k), _mm_packus_epi16(words, words));
+        }
+#elif defined(__SSE2__)
+        const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(0.999f), scale = _mm_set1_ps(256.0f);
+        for (; k + 4 <= n; k += 4) {
+            __m128 x = _mm_max_ps(_mm_loadu_ps(in + k), zero);
+            __m128 g = _mm_min_ps(_mm_sqrt_ps(x), top);
+            __m128i v = _mm_cvttps_epi32(_mm_mul_ps(g, scale));
+            __m128i words = _mm_packs_epi32(v, v);
+            int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+            std::memcpy(out + k, &packed, 4);
+        }
+#endif
+        for (; k < n; k++) {
+            float x = in[k] > 0.0f ? in[k] : 0.0f; // also maps NaN to 0
+            float g = std::fmin(std::sqrt(x), 0.999f);
+            out[k] = uint8_t(int(256.0f * g));
+        }
+    } else {
+        const float inv_gamma = float(1.0 / gamma);
+        for (size_t k = 0; k < n; k++) {
+            float x = in[k] > 0.0f ? in[k] : 0.0f;
+            float g = std::fmin(std::pow(x, inv_gamma), 0.999f);
+            out[k] = uint8_t(int(256.0f * g));
+        }
+    }
+}
+
+
+// * binary PPM (P6) of tonemapped bytes
+inline bool write_ppm(std::ostream& out, int width, int height, const std::vector<uint8_t>& bytes) {
+    out << "P6\n" << width << ' ' << height << "\n255\n";
+    out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+    return bool(out);
+}
+
+// * PFM: linear floats, no tonemapping. Rows go bottom to top, a negative scale means little endian.
+inline bool write_pfm(std::ostream& out, const framebuffer& image) {
+    const uint16_t probe = 1;
+    bool little_endian = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    out << "PF\n" << image.width << ' ' << image.height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+    size_t row_floats = size_t(image.width) * 3;
+    for (int j = image.height - 1; j >= 0; j--)
+        out.write(reinterpret_cast<const char*>(&image.rgb[j * row_floats]), std::streamsize(row_floats * sizeof(float)));
+    return bool(out);
+}
+
+// * Write the image in the given format to a file, or to stdout if path is empty (ppm, pfm
+// and exr only). A file goes to a temporary name first and is renamed, so readers never see
+// half an image. gamma applies to the 8-bit formats, compression to exr.
+inline bool write_image(const framebuffer& image, const std::string& path, image_format format,
+                        double gamma = 2.0, exr_compression compression = exr_compression::zip) {
+    bool hdr_format = format == image_format::pfm || format == image_format::exr || format == image_format::hdr;
+    std::vector<uint8_t> bytes;
+    if (!hdr_format)
+        tonemap_to_bytes(image, bytes, gamma);
+
+    auto write_stream = [&](std::ostream& out) {
+        switch (format) {
+            case image_format::pfm: return write_pfm(out, image);
+            case image_format::exr: return write_exr(out, image.width, image.height, image.rgb.data(), compression);
+            default:                return write_ppm(out, image.width, image.height, bytes);
+        }
+    };
+
+    if (path.empty())
+        return write_stream(std::cout) && bool(std::cout.flush());
+
+    std::string temporary = path + ".tmp";
+    bool ok;
+    if (format == image_format::png) {
+        ok = stbi_write_png(temporary.c_str(), image.width, image.height, 3, bytes.data(), image.width * 3) != 0;
+    } else if (format == image_format::hdr) {
+        // Radiance RGBE with run-length encoded scanlines
+        ok = stbi_write_hdr(temporary.c_str(), image.width, image.height, 3, image.rgb.data()) != 0;
+    } else {
+        std::ofstream out(temporary, std::ios::binary);
+        ok = out && write_stream(out);
+    }
+    return ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+
+// * Writes images on a background thread, so the caller can go on with the next frame or pass.
+// One write is in flight at a time: a new write (or the destructor) waits for the previous one.
+class image_writer {
+    public:
+        image_writer() = default;
+        image_writer(const image_writer&) = delete;
+        image_writer& operator=(const image_writer&) = delete;
+        ~image_writer() { wait(); }
+
+        // takes the image by value; move it in to avoid the copy
+        void write(framebuffer image, std::string path, double gamma = 2.0,
+                   exr_compression compression = exr_compression::zip) {
+            wait();
+            worker = std::thread([image = std::move(image), path = std::move(path), gamma, compression] {
+                if (!write_image(image, path, format_from_path(path), gamma, compression))
+                    std::clog << "\nCannot write " << (path.empty() ? "image to stdout" : path) << "\n";
+            });
+        }
+
+        void wait() {
+            if (worker.joinable()) worker.join();
+        }
+
+    private:
+        std::thread worker;
+};
+
+#endif
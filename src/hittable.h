@@ -3,6 +3,11 @@
 
 #include "rtweekend.h"
 #include "aabb.h"
+#include "affine.h"
+#include "ray_packet.h"
+
+#include <atomic>
+#include <typeinfo>
 
 
 class material; // forward declaration of material class
@@ -12,7 +17,9 @@ class hit_record {
     public:
         point3 p; // hit point
         vec3 normal; // normal of the object
-        shared_ptr<material> mat; // material of the object
+        const material* mat; // material of the object, owned by the scene (no refcounting per hit)
+        uint32_t primitive_id; // object_id of the primitive that was hit, combined with the face of a mesh
+                               // and the placement of an instance (see combine_ids)
         double t; // t value of the hit point
         double u; // u coordinate of the hit point
         double v; // v coordinate of the hit point
@@ -32,21 +39,53 @@ class hit_record {
 };
 
 
+// * ids in creation order, so a scene built the same way numbers its objects the same way
+inline std::atomic<uint32_t> next_object_id{1};
+
+// * id of a part (a face, the hit inside an instance) of object `id`; never 0, the background
+inline uint32_t combine_ids(uint32_t id, uint32_t part) {
+    uint32_t h = hash32(id * 0x9e3779b9u ^ hash32(part + 1));
+    return h ? h : 1;
+}
+
 // hittable is a class for objects that can be hit by a ray
 class hittable {
     public:
+        uint32_t object_id = next_object_id.fetch_add(1, std::memory_order_relaxed); // for the ID AOV
+
         // ? virtual destructor (need to learn more)
         virtual ~hittable() = default; // virtual destructor
 
         // virtual function hit, return true if the ray hits the object
         // r:ray
         // ray_tmin, ray_tmax: the range of t value of the ray
-        // rec: hit_record
+        // rec: hit_record, only written when the function returns true (so callers can pass
+        //      their own record and keep the closest hit without a temporary copy)
         // ! Deprecated: virtual bool hit (const ray& r, double ray_tmin, double ray_tmax, hit_record& rec) const = 0;
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
         // * `= 0` means this function is a pure virtual function, which means this function must be implemented in the derived class
 
         virtual aabb bounding_box() const = 0; // for bvhtree
+
+        // * is there any hit in ray_t at all? For shadow rays and light visibility, which only
+        // * need the answer: overrides build no hit record (no point, normal, uv or material)
+        // * and stop at the first hit found, not the closest. The default asks hit().
+        virtual bool occluded(const ray& r, interval ray_t) const {
+            hit_record rec;
+            return hit(r, ray_t, rec);
+        }
+
+        // * closest hits of a packet of rays (see ray_packet.h): every ray of `lanes` that hits
+        // this object closer than its t_max records the hit. The default tests the rays one by
+        // one with hit(); aggregates pass the packet on, primitives test it with SIMD.
+        virtual void hit_packet(ray_packet& packet, uint32_t lanes) const {
+            for (int l = 0; l < packet.size; l++) {
+                if (!(lanes & (1u << l))) continue;
+                hit_record rec;
+                if (hit(packet.lane_ray(l), interval(packet.t_min, packet.t_max[l]), rec))
+                    packet.record_hit(l, rec.t, this);
+            }
+        }
         
         virtual double pdf_value(const point3& origin, const vec3& direction
         ) const {
@@ -86,6 +125,10 @@ class translate : public hittable {
             return true;
         }
 
+        bool occluded(const ray& r, interval ray_t) const override {
+            return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+        }
+
         aabb bounding_box() const override {
             return bbox;
         }
@@ -131,18 +174,7 @@ public:
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto origin = r.origin();
-        auto direction = r.direction();
-
-        origin[1] = cos_theta*r.origin()[1] - sin_theta*r.origin()[2];
-        origin[2] = sin_theta*r.origin()[1] + cos_theta*r.origin()[2];
-
-        direction[1] = cos_theta*r.direction()[1] - sin_theta*r.direction()[2];
-        direction[2] = sin_theta*r.direction()[1] + cos_theta*r.direction()[2];
-
-        ray rotated_r(origin, direction, r.time());
-
-        if (!object->hit(rotated_r, ray_t, rec))
+        if (!object->hit(to_object(r), ray_t, rec))
             return false;
 
         auto p = rec.p;
@@ -159,6 +191,10 @@ public:
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(to_object(r), ray_t);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
 private:
@@ -166,6 +202,20 @@ private:
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    // the ray in object space
+    ray to_object(const ray& r) const {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[1] = cos_theta*r.origin()[1] - sin_theta*r.origin()[2];
+        origin[2] = sin_theta*r.origin()[1] + cos_theta*r.origin()[2];
+
+        direction[1] = cos_theta*r.direction()[1] - sin_theta*r.direction()[2];
+        direction[2] = sin_theta*r.direction()[1] + cos_theta*r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 
@@ -205,20 +255,8 @@ class rotate_y : public hittable {
     
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            // Change the ray from world space to object space
-            auto origin = r.origin();
-            auto direction = r.direction();
-
-            origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
-            origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
-
-            direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
-            direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
-
-            ray rotated_r(origin, direction, r.time());
-
             // Determine whether an intersection exists in object space (and if so, where)
-            if (!object->hit(rotated_r, ray_t, rec))
+            if (!object->hit(to_object(r), ray_t, rec))
                 return false;
 
             // Change the intersection point from object space to world space
@@ -237,6 +275,10 @@ class rotate_y : public hittable {
             return true;
         }
 
+        bool occluded(const ray& r, interval ray_t) const override {
+            return object->occluded(to_object(r), ray_t);
+        }
+
         aabb bounding_box() const override { return bbox; }
     
     private:
@@ -244,6 +286,20 @@ class rotate_y : public hittable {
         double sin_theta;
         double cos_theta;
         aabb bbox;
+
+        // Change the ray from world space to object space
+        ray to_object(const ray& r) const {
+            auto origin = r.origin();
+            auto direction = r.direction();
+
+            origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
+            origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
+
+            direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
+            direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
+
+            return ray(origin, direction, r.time());
+        }
 };
 
 class rotate_z : public hittable {
@@ -281,18 +337,7 @@ public:
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto origin = r.origin();
-        auto direction = r.direction();
-
-        origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[1];
-        origin[1] = sin_theta*r.origin()[0] + cos_theta*r.origin()[1];
-
-        direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[1];
-        direction[1] = sin_theta*r.direction()[0] + cos_theta*r.direction()[1];
-
-        ray rotated_r(origin, direction, r.time());
-
-        if (!object->hit(rotated_r, ray_t, rec))
+        if (!object->hit(to_object(r), ray_t, rec))
             return false;
 
         auto p = rec.p;
@@ -309,6 +354,10 @@ public:
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(to_object(r), ray_t);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
 private:
@@ -316,6 +365,98 @@ private:
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    // the ray in object space
+    ray to_object(const ray& r) const {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[1];
+        origin[1] = sin_theta*r.origin()[0] + cos_theta*r.origin()[1];
+
+        direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[1];
+        direction[1] = sin_theta*r.direction()[0] + cos_theta*r.direction()[1];
+
+        return ray(origin, direction, r.time());
+    }
+};
+
+
+// * One affine transform in place of a translate / rotate_x / rotate_y / rotate_z chain.
+// The ray is transformed once on the way in and the hit record once on the way out.
+// Wrapping a plain transform in another one composes the two matrices at build time,
+// so the chain never costs more than one virtual hop per hit.
+class transform : public hittable {
+    public:
+        transform(shared_ptr<hittable> object, const affine3& object_to_world)
+         : object(object), object_to_world(object_to_world) {
+            // * fold a nested transform (but not a subclass, which may carry more state)
+            if (auto inner = std::dynamic_pointer_cast<transform>(object); inner && typeid(*inner) == typeid(transform)) {
+                this->object = inner->object;
+                this->object_to_world = object_to_world * inner->object_to_world;
+            }
+            world_to_object = this->object_to_world.inverse();
+            normal_scale = this->object_to_world.uniform_scale();
+            bbox = this->object_to_world.box(this->object->bounding_box());
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            // * the direction is not renormalized, so t means the same in both spaces
+            ray object_r(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+
+            if (!object->hit(object_r, ray_t, rec))
+                return false;
+
+            // t is shared, so the world space point comes straight from the original ray;
+            // front_face carries over: dot(M^-T n, M d) == dot(n, d)
+            rec.p = r.at(rec.t);
+            vec3 normal = world_to_object.normal_from_inverse(rec.normal);
+            // rotation and uniform scale: the length is known, no square root per hit
+            rec.normal = normal_scale > 0 ? normal * normal_scale : unit_vector(normal);
+
+            return true;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            ray object_r(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+            return object->occluded(object_r, ray_t);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // * the packet goes to the object in object space (t is shared); lanes the object hits
+        // * record this transform, whose hit() fills the record in world space
+        void hit_packet(ray_packet& packet, uint32_t lanes) const override {
+            ray rays[ray_packet::max_size];
+            for (int l = 0; l < packet.size; l++) {
+                ray r = packet.lane_ray(l);
+                rays[l] = ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+            }
+            ray_packet object_packet(rays, packet.size, interval(packet.t_min, infinity));
+            for (int l = 0; l < packet.size; l++) {
+                object_packet.t_max[l] = packet.t_max[l];
+                object_packet.t_far[l] = packet.t_far[l];
+            }
+
+            object->hit_packet(object_packet, lanes);
+
+            for (int l = 0; l < packet.size; l++) {
+                if (!(lanes & (1u << l))) continue;
+                if (object_packet.retrace[l])
+                    packet.record_retrace(l, object_packet.t_max[l]);
+                else if (object_packet.closest[l])
+                    packet.record_hit(l, object_packet.t_max[l], this);
+            }
+        }
+
+        const affine3& matrix() const { return object_to_world; }
+
+    protected:
+        shared_ptr<hittable> object;
+        affine3 object_to_world;
+        affine3 world_to_object;
+        double normal_scale; // uniform scale of object_to_world, 0 if normals must be renormalized
+        aabb bbox; // world space box
 };
 
 
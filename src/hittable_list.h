@@ -35,7 +35,6 @@ class hittable_list : public hittable {
         // check if the ray hits the object in the list
         // if hit: true, then record the hit info
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            hit_record temp_rec; // temporary hit record
             bool hit_anything = false; // flag for if hit or not
 
             // tmax is the maximum t value of the ray
@@ -45,23 +44,39 @@ class hittable_list : public hittable {
             // loop through all the objects in the list
             for (const auto& object : objects) {
                 // if the ray hits the object
-                if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                // * objects only write rec on a hit, and every hit is closer than the last one
+                if (object->hit(r, interval(ray_t.min, closest_so_far), rec)) {
                     hit_anything = true; // set the hit flag to true
-                    closest_so_far = temp_rec.t; // update the closest_so_far to the t value of the hit point
-                    rec = temp_rec; // update the hit record
+                    closest_so_far = rec.t; // update the closest_so_far to the t value of the hit point
                 }
             }
 
             return hit_anything; // return the hit flag
         }
 
+        // * any object will do, the first one hit ends the search
+        bool occluded(const ray& r, interval ray_t) const override {
+            for (const auto& object : objects)
+                if (object->occluded(r, ray_t))
+                    return true;
+            return false;
+        }
+
         aabb bounding_box() const override {
             return bbox; // return the bounding box
         }
 
+        // * every object sees the packet in turn, each one only records closer hits
+        void hit_packet(ray_packet& packet, uint32_t lanes) const override {
+            for (const auto& object : objects)
+                object->hit_packet(packet, lanes);
+        }
+
         // Function to compute the PDF value based on the origin and direction
         // It loops over all objects in the hittable list and calculates the weighted PDF
         double pdf_value(const point3& origin, const vec3& direction) const override {
+            if (objects.empty()) return 0; // nothing to sample: random() never produces a direction
+
             auto weight = 1.0 / objects.size(); // Each object's weight is the reciprocal of the total number of objects
             auto sum = 0.0; // Initialize the sum of PDF values
 
@@ -76,6 +91,7 @@ class hittable_list : public hittable {
         vec3 random(const point3& origin) const override {
             // Randomly select an object from the hittable list
             auto int_size = int(objects.size());
+            if (int_size == 0) return vec3(1, 0, 0); // any direction, its pdf_value is 0
             return objects[random_int(0, int_size-1)]->random(origin); // Generate a random direction towards that object
         }
     
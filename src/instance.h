@@ -0,0 +1,32 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+
+#include "affine.h"
+#include "hittable.h"
+
+// * one placement of a shared bottom-level structure (a triangle_mesh, a bvh_node, ...).
+// An instance is a transform plus an optional material override, so thousands of copies
+// cost about the memory of one. A bvh_node built over instances is the top-level
+// acceleration structure.
+class instance : public transform {
+    public:
+        // mat: replaces the material of every hit when set, keeps the object's own when null
+        instance(shared_ptr<hittable> object, const affine3& object_to_world,
+                 shared_ptr<material> mat = nullptr)
+         : transform(object, object_to_world), mat(mat) {}
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (!transform::hit(r, ray_t, rec))
+                return false;
+            if (mat) rec.mat = mat.get();
+            rec.primitive_id = combine_ids(object_id, rec.primitive_id); // the same face differs between placements
+            return true;
+        }
+
+    private:
+        shared_ptr<material> mat; // material override, may be null
+};
+
+#endif
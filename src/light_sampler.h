@@ -0,0 +1,469 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "color.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// * how the light of a shadow ray is chosen
+enum class light_selection {
+    uniform, // every light of the list equally often, emitting or not
+    power,   // in proportion to the light's power, from an alias table
+    bvh      // by the power each part of the light bvh can send towards the shading point
+};
+
+
+// * Walker's alias method (Vose's construction): O(1) sampling of a discrete distribution.
+// Every bin holds one entry with probability `q` and hands the rest of its 1/n to `alias`.
+class alias_table {
+    public:
+        alias_table() = default;
+
+        // weights >= 0, at least one of them > 0
+        explicit alias_table(const std::vector<double>& weights) : bins(weights.size()) {
+            const size_t n = weights.size();
+            double total = 0;
+            for (double w : weights) total += w;
+
+            std::vector<uint32_t> small, large;
+            std::vector<double> scaled(n);
+            for (size_t i = 0; i < n; i++) {
+                bins[i].pmf = weights[i] / total;
+                scaled[i] = bins[i].pmf * n;
+                (scaled[i] < 1 ? small : large).push_back(uint32_t(i));
+            }
+            while (!small.empty() && !large.empty()) {
+                uint32_t s = small.back(), l = large.back();
+                small.pop_back();
+                bins[s].q = scaled[s];
+                bins[s].alias = l;
+                scaled[l] -= 1 - scaled[s];
+                if (scaled[l] < 1) {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // what is left is 1 up to rounding
+            for (uint32_t i : large) bins[i].q = 1;
+            for (uint32_t i : small) bins[i].q = 1;
+        }
+
+        size_t size() const { return bins.size(); }
+
+        double pmf(uint32_t i) const { return bins[i].pmf; }
+
+        // * entry for a uniform u in [0, 1)
+        uint32_t sample(double u) const {
+            double scaled = u * double(bins.size());
+            auto i = std::min(uint32_t(scaled), uint32_t(bins.size() - 1));
+            return scaled - i < bins[i].q ? i : bins[i].alias;
+        }
+
+    private:
+        struct bin {
+            double q = 1;       // probability of keeping the bin's own entry
+            uint32_t alias = 0; // entry taken otherwise
+            double pmf = 0;     // probability of the entry overall
+        };
+        std::vector<bin> bins;
+};
+
+
+// * Bounds of a set of lights for the light bvh (Conty Estevez and Kulla 2018): their box,
+// total power, and an orientation cone. The surface normals lie within theta_o of axis, and
+// each surface emits within theta_e of its normal.
+struct light_bounds {
+    aabb box = aabb::empty;
+    double power = 0;
+    vec3 axis = vec3(0, 0, 1);
+    double theta_o = pi;      // pi: any orientation
+    double theta_e = pi / 2;
+    double cos_theta_o = -1, sin_theta_o = 0, cos_theta_e = 0; // kept for importance()
+
+    void set_cone(const vec3& cone_axis, double cone_theta_o, double cone_theta_e) {
+        axis = cone_axis;
+        theta_o = cone_theta_o;
+        theta_e = cone_theta_e;
+        cos_theta_o = std::cos(theta_o);
+        sin_theta_o = std::sin(theta_o);
+        cos_theta_e = std::cos(theta_e);
+    }
+
+    // * the smallest cone around both cones (pbrt-v4's Union of DirectionCones)
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        if (!(a.power > 0)) return b;
+        if (!(b.power > 0)) return a;
+
+        light_bounds result;
+        result.box = aabb(a.box, b.box);
+        result.power = a.power + b.power;
+        double theta_e = std::fmax(a.theta_e, b.theta_e);
+
+        const light_bounds& wide = a.theta_o >= b.theta_o ? a : b;
+        const light_bounds& narrow = a.theta_o >= b.theta_o ? b : a;
+        double cos_d = std::clamp(dot(wide.axis, narrow.axis), -1.0, 1.0);
+        double theta_d = std::acos(cos_d);
+        if (std::fmin(theta_d + narrow.theta_o, pi) <= wide.theta_o) {
+            result.set_cone(wide.axis, wide.theta_o, theta_e);
+            return result;
+        }
+
+        // rotate the wide axis towards the narrow one, to the middle of the spread
+        double theta_o = 0.5 * (wide.theta_o + theta_d + narrow.theta_o);
+        vec3 across = narrow.axis - cos_d * wide.axis;
+        if (theta_o >= pi || across.length_squared() < 1e-12) {
+            result.set_cone(wide.axis, pi, theta_e);
+            return result;
+        }
+        double theta_r = theta_o - wide.theta_o;
+        result.set_cone(unit_vector(std::cos(theta_r) * wide.axis + std::sin(theta_r) * unit_vector(across)),
+                        theta_o, theta_e);
+        return result;
+    }
+
+    // * Upper bound on the light the set may send to p: power / squared distance, times the
+    // cosine of the smallest angle between the cone and the direction to p, with the box's
+    // angular size subtracted. 0 when p lies outside every emission cone.
+    double importance(const point3& p) const {
+        point3 center = box.centroid();
+        vec3 half = 0.5 * (point3(box.x.max, box.y.max, box.z.max) - point3(box.x.min, box.y.min, box.z.min));
+        double radius_squared = half.length_squared();
+
+        vec3 to_p = p - center;
+        double distance_squared = to_p.length_squared();
+        // inside the box's sphere the distance is unknown, its radius stands in for it
+        double falloff = power / std::fmax(distance_squared, radius_squared);
+        if (theta_o >= pi || !(distance_squared > radius_squared)) return falloff;
+
+        // cosine of max(0, theta_w - theta_o - theta_b) from the sines and cosines (no trigonometry)
+        double cos_w = std::clamp(dot(axis, to_p) / std::sqrt(distance_squared), -1.0, 1.0);
+        double sin_w = std::sqrt(1 - cos_w * cos_w);
+        double sin_b = std::sqrt(radius_squared / distance_squared);
+        double cos_b = std::sqrt(1 - sin_b * sin_b);
+
+        double cos_x = 1, sin_x = 0; // theta_x = max(0, theta_w - theta_o)
+        if (cos_w < cos_theta_o) {
+            cos_x = cos_w * cos_theta_o + sin_w * sin_theta_o;
+            sin_x = sin_w * cos_theta_o - cos_w * sin_theta_o;
+        }
+        double cos_theta = cos_x < cos_b ? cos_x * cos_b + sin_x * sin_b : 1;
+        if (cos_theta <= cos_theta_e) return 0;
+        return falloff * cos_theta;
+    }
+};
+
+
+// * a point sampled on a light for a shadow ray from `origin` (light_sampler::sample)
+struct light_sample {
+    vec3 direction;  // towards the point, which lies at origin + t * direction
+    double t;
+    color emission;  // radiance the point sends back towards origin
+    double pdf;      // solid-angle density of direction (light_sampler::pdf_at)
+};
+
+
+// * The lights of a scene sampled for next-event estimation, built from the light list (a
+// hittable_list, or any single hittable) a scene passes to the camera. The list repeats the
+// geometry of the emitters, usually with a null material. Each light is first probed against
+// the world (see probe): the probes find the material of the world's emitter where the light
+// is (so a shadow ray can evaluate the emission itself and only needs an occlusion test), its
+// power (the emission integrated over the light) and the directions it emits in.
+//   - uniform: every light equally often.
+//   - power: one light per shadow ray from an alias table of the powers, O(1). Lights that
+//     emit nothing (e.g. a glass sphere listed to guide rays towards it) are left out; they
+//     only cost shadow rays that find nothing.
+//   - bvh: as power, but by a walk down a bvh over the lights, each step choosing a child in
+//     proportion to its light_bounds::importance at the shading point: near lights facing it win.
+// pdf_at() traverses the same bvh with the ray and visits only the lights it meets, so it costs
+// O(log n) instead of a loop over every light. Lights are sampled as they are at time 0 (as
+// hittable::pdf_value does). The sampler only points at the lights: the light list must
+// outlive it.
+class light_sampler {
+    public:
+        static constexpr int probe_count = 64; // probe rays per light
+        static constexpr double both_sides_cosine = -0.5;  // emission beyond 120 degrees of the axis
+        static constexpr double cone_padding = 0.2618;    // 15 degrees on top of one-sided cones
+
+        static constexpr double point_tolerance = 1e-4; // relative difference in t of the same light point;
+                                                        // a shadow ray is blocked before (1 - point_tolerance) t
+
+        light_sampler(const hittable& light_list, const hittable& world, light_selection method)
+         : method(method) {
+            std::vector<const hittable*> candidates;
+            if (auto list = dynamic_cast<const hittable_list*>(&light_list)) {
+                for (const auto& object : list->objects)
+                    candidates.push_back(object.get());
+            } else {
+                candidates.push_back(&light_list);
+            }
+
+            auto n = int64_t(candidates.size());
+            std::vector<light_bounds> probed(n);
+            std::vector<const material*> emitters(n);
+            std::vector<uint8_t> facing(n);
+            #pragma omp parallel for schedule(dynamic, 16) if (n >= 256)
+            for (int64_t i = 0; i < n; i++) {
+                bool flip;
+                probed[i] = probe(*candidates[i], world, uint64_t(i), emitters[i], flip);
+                facing[i] = flip;
+            }
+
+            std::vector<int64_t> kept;
+            if (method != light_selection::uniform) {
+                for (int64_t i = 0; i < n; i++)
+                    if (probed[i].power > 0) kept.push_back(i);
+            }
+            if (kept.empty()) {
+                // uniform, or no emission found at all: sample every light alike
+                for (int64_t i = 0; i < n; i++) {
+                    kept.push_back(i);
+                    probed[i].power = 1;
+                    probed[i].set_cone(probed[i].axis, pi, pi / 2);
+                }
+            }
+            if (kept.empty()) return;
+
+            // * the bvh over the light boxes; lights are stored in its leaf order
+            std::vector<aabb> boxes;
+            for (int64_t i : kept) boxes.push_back(probed[i].box);
+            bvh_builder builder(boxes, bvh_split::sah);
+            nodes = std::move(builder.nodes);
+            for (uint32_t index : builder.order) {
+                int64_t i = kept[index];
+                lights.push_back(candidates[i]);
+                materials.push_back(emitters[i]);
+                flipped.push_back(facing[i]);
+                bounds.push_back(probed[i]);
+            }
+
+            std::vector<double> powers;
+            for (const auto& b : bounds) powers.push_back(b.power);
+            table = alias_table(powers);
+
+            // * node bounds bottom-up: children always come after their parent
+            node_bounds.resize(nodes.size());
+            parent.assign(nodes.size(), 0);
+            leaf.resize(lights.size());
+            for (size_t k = nodes.size(); k-- > 0;) {
+                const linear_bvh_node& node = nodes[k];
+                if (node.count > 0) {
+                    light_bounds b;
+                    for (uint32_t s = node.offset; s < node.offset + node.count; s++) {
+                        b = light_bounds::merge(b, bounds[s]);
+                        leaf[s] = uint32_t(k);
+                    }
+                    node_bounds[k] = b;
+                } else {
+                    node_bounds[k] = light_bounds::merge(node_bounds[k + 1], node_bounds[node.offset]);
+                    parent[k + 1] = parent[node.offset] = uint32_t(k);
+                }
+            }
+        }
+
+        size_t size() const { return lights.size(); }
+
+        // * A point on a light for a shadow ray from origin, with the emission it sends there.
+        // Returns false when there is none (no light reaches origin, the point sends nothing
+        // that way); nothing else is traced, the caller only tests the way to it for occlusion.
+        bool sample(const point3& origin, light_sample& s) const {
+            if (lights.empty()) return false;
+            double u = random_double();
+            int k = method == light_selection::bvh ? select_bvh(origin, u) : int(table.sample(u));
+            if (k < 0 || !materials[k]) return false;
+
+            s.direction = lights[k]->random(origin);
+            ray r(origin, s.direction);
+            hit_record rec;
+            if (!lights[k]->hit(r, interval(0.001, infinity), rec))
+                return false;
+            if (flipped[k]) {
+                // the light's geometry faces the other way than the world's emitter
+                rec.front_face = !rec.front_face;
+                rec.normal = -rec.normal;
+            }
+            rec.mat = materials[k];
+            s.emission = materials[k]->emitted(r, rec, rec.u, rec.v, rec.p);
+            if (!(s.emission.x() > 0 || s.emission.y() > 0 || s.emission.z() > 0))
+                return false;
+            s.t = rec.t;
+            s.pdf = pdf_at(origin, s.direction, s.t);
+            return s.pdf > 0;
+        }
+
+        // * Density with which sample() chooses `direction` from origin and reaches the point at
+        // t along it: the lights whose surface the ray meets there (usually just one), each
+        // with the probability of choosing it times the density of its own direction sampling.
+        // A light behind that point does not count, its own point is hidden from origin.
+        double pdf_at(const point3& origin, const vec3& direction, double t) const {
+            if (lights.empty()) return 0;
+            double sum = 0;
+            ray r(origin, direction);
+            traverse_bvh(nodes, r, interval(0.001, infinity),
+                [&](uint32_t first, uint32_t count, interval&) {
+                    for (uint32_t k = first; k < first + count; k++) {
+                        hit_record rec;
+                        if (!materials[k] || !lights[k]->hit(r, interval(0.001, infinity), rec)
+                            || std::fabs(rec.t - t) > point_tolerance * t)
+                            continue;
+                        sum += selection_probability(k, origin) * lights[k]->pdf_value(origin, direction);
+                    }
+                    return false; // the box tests stay against the whole ray
+                });
+            return sum;
+        }
+
+    private:
+        light_selection method;
+        std::vector<const hittable*> lights;      // in bvh leaf order
+        std::vector<const material*> materials;   // per light: the world emitter's, null if none was found
+        std::vector<uint8_t> flipped;             // per light: it faces the other way than that emitter
+        std::vector<light_bounds> bounds;         // per light
+        alias_table table;                        // per light, by power
+        std::vector<linear_bvh_node> nodes;       // bvh over the light boxes
+        std::vector<light_bounds> node_bounds;    // per node
+        std::vector<uint32_t> parent;             // per node (the root's is unused)
+        std::vector<uint32_t> leaf;               // per light: its leaf node
+
+        // * Power and emission cone of one light, from probe rays. The probes start on a sphere
+        // around the light, at four times its radius, and aim at points light.random() draws on
+        // it. The emission of the world's surface at that point, divided by the probe's
+        // density, averages to R^2 times the mean radiance the light sends over the sphere's
+        // solid angle - for a lambertian emitter its power / 4pi at any size or shape (Cauchy's
+        // mean projected area), so all lights are weighed alike. The world is only queried in a
+        // tiny interval around the point: whatever surrounds the light does not hide it.
+        // The cone covers the directions the emission left in: a one-sided quad gets its
+        // front hemisphere (padded), a sphere every direction.
+        // emitter receives the material of the world's surface at the light (null if none was
+        // met), flipped whether that surface faces the other way than the light's own.
+        static light_bounds probe(const hittable& light, const hittable& world, uint64_t index,
+                                  const material*& emitter, bool& flipped) {
+            emitter = nullptr;
+            flipped = false;
+            light_bounds result;
+            result.box = light.bounding_box();
+            point3 center = result.box.centroid();
+            point3 corner(result.box.x.max, result.box.y.max, result.box.z.max);
+            double probe_radius = 4 * (corner - center).length();
+            double epsilon = 1e-6 * probe_radius;
+
+            // a stream of its own per light, apart from the pixels' streams
+            rng_start_sample(~index, 0);
+
+            double sum = 0;
+            vec3 outgoing_sum(0, 0, 0);
+            std::vector<vec3> outgoing;
+            for (int k = 0; k < probe_count; k++) {
+                point3 origin = center + probe_radius * random_unit_vector();
+                vec3 direction = light.random(origin);
+                double density = light.pdf_value(origin, direction);
+                hit_record light_rec;
+                if (!(density > 0) || !light.hit(ray(origin, direction), interval(0.001, infinity), light_rec))
+                    continue;
+
+                vec3 d = unit_vector(direction);
+                ray at_light(light_rec.p - epsilon * d, d, 0);
+                hit_record rec;
+                if (!world.hit(at_light, interval(0, 2 * epsilon), rec) || !rec.mat)
+                    continue;
+                if (!emitter) {
+                    emitter = rec.mat;
+                    flipped = rec.front_face != light_rec.front_face;
+                }
+                double radiance = luminance(rec.mat->emitted(at_light, rec, rec.u, rec.v, rec.p));
+                if (!(radiance > 0)) continue;
+
+                sum += radiance / density;
+                outgoing_sum += (radiance / density) * -d;
+                outgoing.push_back(-d);
+            }
+            result.power = sum / probe_count * probe_radius * probe_radius;
+            if (outgoing.empty() || outgoing_sum.length_squared() == 0)
+                return result;
+
+            // * normals within theta_o of the mean direction, each emitting into its hemisphere.
+            // Emission seen well behind the axis means the light emits on both sides (a sphere):
+            // any orientation. Otherwise the axis is a mean of a few noisy directions, and the
+            // grazing ones the probes missed may reach a little further than the widest seen,
+            // so the cone gets cone_padding on top of what they show.
+            vec3 axis = unit_vector(outgoing_sum);
+            double lowest = 1;
+            for (const vec3& out : outgoing)
+                lowest = std::fmin(lowest, dot(axis, out));
+            if (lowest < both_sides_cosine) {
+                result.set_cone(axis, pi, pi / 2);
+                return result;
+            }
+            double spread = std::acos(std::clamp(lowest, -1.0, 1.0));
+            result.set_cone(axis, std::fmax(0.0, spread - pi / 2) + cone_padding, pi / 2);
+            return result;
+        }
+
+        // * probability that sample() picks light s from origin
+        double selection_probability(uint32_t s, const point3& origin) const {
+            if (method != light_selection::bvh) return table.pmf(s);
+
+            const linear_bvh_node& node = nodes[leaf[s]];
+            double own = bounds[s].importance(origin), total = 0;
+            for (uint32_t k = node.offset; k < node.offset + node.count; k++)
+                total += bounds[k].importance(origin);
+            if (!(own > 0)) return 0;
+
+            double probability = own / total;
+            for (uint32_t child = leaf[s]; child != 0; child = parent[child]) {
+                uint32_t up = parent[child];
+                double first = node_bounds[up + 1].importance(origin);
+                double second = node_bounds[nodes[up].offset].importance(origin);
+                if (!(first + second > 0)) return 0;
+                probability *= (child == up + 1 ? first : second) / (first + second);
+            }
+            return probability;
+        }
+
+        // * walk down the bvh with one uniform number, rescaled at every choice; -1 when no
+        // * light can reach origin
+        int select_bvh(const point3& origin, double u) const {
+            constexpr double below_one = 0x1.fffffffffffffp-1;
+            uint32_t current = 0;
+            while (nodes[current].count == 0) {
+                double first = node_bounds[current + 1].importance(origin);
+                double second = node_bounds[nodes[current].offset].importance(origin);
+                if (!(first + second > 0)) return -1;
+                double p = first / (first + second);
+                if (u < p) {
+                    u = std::fmin(u / p, below_one);
+                    current = current + 1;
+                } else {
+                    u = std::fmin((u - p) / (1 - p), below_one);
+                    current = nodes[current].offset;
+                }
+            }
+
+            const linear_bvh_node& node = nodes[current];
+            double total = 0;
+            for (uint32_t k = node.offset; k < node.offset + node.count; k++)
+                total += bounds[k].importance(origin);
+            if (!(total > 0)) return -1;
+            double target = u * total;
+            int chosen = -1;
+            for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+                double w = bounds[k].importance(origin);
+                if (!(w > 0)) continue;
+                chosen = int(k);
+                if (target < w) break;
+                target -= w;
+            }
+            return chosen;
+        }
+};
+
+#endif
@@ -6,19 +6,39 @@
 #include "hittable_list.h"
 #include "sphere.h"
 #include "triangle.h"
+#include "triangle_mesh.h"
+#include "instance.h"
 #include "quad.h"
 #include "material.h"
 #include "bvh.h"
+#include "bvh4.h"
 #include "texture.h"
 #include "hdr_texture.h"
 
 
 #include <iostream>
 #include <chrono>
+#include <cstdlib>
+#include <new>
+#include <string>
 #include <Eigen/Core>
 #include <igl/readOBJ.h>
 
 
+#ifdef RTW_COUNT_ALLOCATIONS
+// * count every heap allocation per thread, so the camera can check that tracing allocates nothing
+void* operator new(std::size_t size) {
+    thread_allocations++;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#endif
+
+
 void bouncing_spheres() {
 
     // ! Deprecated (refactored)
@@ -370,12 +390,11 @@ void cornell_box() {
     // * box and glass sphere----------
     // Box
     shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    // * rotate other axis-----------------
-    // box1 = make_shared<rotate_x>(box1, 30);
-    // box1 = make_shared<rotate_z>(box1, 15);
-    // * ---------------------------------
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    box1 = make_shared<transform>(box1, affine3::translation(vec3(265,0,295))
+                                      // * rotate other axis-----------------
+                                      // * affine3::rotation_z(15) * affine3::rotation_x(30)
+                                      // * ---------------------------------
+                                      * affine3::rotation_y(15));
     world.add(box1);
 
     // Glass Sphere
@@ -427,12 +446,10 @@ void cornell_smoke() {
     world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
 
     shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    box1 = make_shared<transform>(box1, affine3::translation(vec3(265,0,295)) * affine3::rotation_y(15));
 
     shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    box2 = make_shared<transform>(box2, affine3::translation(vec3(130,0,65)) * affine3::rotation_y(-18));
 
     world.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
     world.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
@@ -510,12 +527,10 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
         boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
     }
 
-    world.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2), 15),
-            vec3(-100,270,395)
-        )
-    );
+    world.add(make_shared<transform>(
+        make_shared<bvh_node>(boxes2),
+        affine3::translation(vec3(-100,270,395)) * affine3::rotation_y(15)
+    ));
 
     camera cam;
 
@@ -559,8 +574,7 @@ void cornell_box_custom() {
     // shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
     shared_ptr<material> aluminum = make_shared<metal>(color(0.8, 0.85, 0.88), 0.0);
     shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), aluminum);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    box1 = make_shared<transform>(box1, affine3::translation(vec3(265,0,295)) * affine3::rotation_y(15));
     world.add(box1);
 
     // // box2
@@ -612,6 +626,33 @@ void cornell_box_custom() {
 }
 
 
+// * Load an OBJ file as one indexed triangle_mesh, scaled and then translated.
+// Returns nullptr if the file cannot be read.
+shared_ptr<triangle_mesh> load_obj_mesh(const std::string& obj_file_path, double scale_factor,
+                                        const vec3& translation, shared_ptr<material> mat) {
+    Eigen::MatrixXd V;
+    Eigen::MatrixXi F;
+    if (!igl::readOBJ(obj_file_path, V, F)) {
+        std::cerr << "Failed to load OBJ file: " << obj_file_path << std::endl;
+        return nullptr;
+    }
+
+    std::vector<float> vertices(3 * V.rows());
+    for (int i = 0; i < V.rows(); ++i)
+        for (int a = 0; a < 3; a++)
+            vertices[3*i + a] = float(scale_factor * V(i, a) + translation[a]);
+
+    std::vector<uint32_t> indices(3 * F.rows());
+    for (int i = 0; i < F.rows(); ++i)
+        for (int k = 0; k < 3; k++)
+            indices[3*i + k] = uint32_t(F(i, k));
+
+    auto mesh = make_shared<triangle_mesh>(std::move(vertices), std::move(indices), mat);
+    std::clog << "Loaded " << obj_file_path << ": " << mesh->face_count() << " triangles, "
+              << mesh->memory_bytes() / 1024 << " KiB\n";
+    return mesh;
+}
+
 void triobj_test() {
     hittable_list world;
 
@@ -635,32 +676,13 @@ void triobj_test() {
     world.add(make_shared<quad>(point3(213,554,227), vec3(130,0,0), vec3(0,0,105), light));
 
     // * triangle mesh ----------
-    Eigen::MatrixXd V;
-    Eigen::MatrixXi F;
-
-
-    std::string obj_file_path = "assets/tree5.obj";
-    if (!igl::readOBJ(obj_file_path, V, F)) {
-        std::cerr << "Failed to load OBJ file." << std::endl;
-        return;
-    }
-
-    // add triangles to world
-    for (int i = 0; i < F.rows(); ++i) {
-        vec3 translation(278, 10, 278);
-        double scale_factor = 4;
-
-        // read triangle vertices
-        vec3 v0 = scale_factor * vec3(V(F(i, 0), 0), V(F(i, 0), 1), V(F(i, 0), 2)) + translation;
-        vec3 v1 = scale_factor * vec3(V(F(i, 1), 0), V(F(i, 1), 1), V(F(i, 1), 2)) + translation;
-        vec3 v2 = scale_factor * vec3(V(F(i, 2), 0), V(F(i, 2), 1), V(F(i, 2), 2)) + translation;
-
-        auto triangle = make_shared<Triangle>(v0, v1, v2, aluminum);
-
-        world.add(triangle);
-    }
+    auto tree = load_obj_mesh("assets/tree5.obj", 4, vec3(278, 10, 278), aluminum);
+    if (!tree) return;
+    world.add(tree);
     // * ------------------------------
 
+    world = hittable_list(make_shared<bvh_node>(world)); // * SAH bvh over the walls and the mesh (which has its own bvh)
+
     // Light Sources
     auto empty_material = shared_ptr<material>();
     hittable_list lights;
@@ -673,7 +695,8 @@ void triobj_test() {
     // camera settings
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 800;
-    cam.samples_per_pixel = 700;
+    cam.samples_per_pixel = 700; // budget: converged pixels stop early
+    cam.adaptive_sampling = true;
     cam.max_depth         = 50;
     cam.background        = color(0,0,0);
 
@@ -733,29 +756,9 @@ void hdr_test2() {
     shared_ptr<material> aluminum = make_shared<metal>(color(0.8, 0.85, 0.88), 0.1);  // 金属材质
 
     // * triangle mesh ----------
-    Eigen::MatrixXd V; 
-    Eigen::MatrixXi F;
-
-
-    std::string obj_file_path = "assets/bg8.obj";  // 替换为你的 OBJ 文件路径
-    if (!igl::readOBJ(obj_file_path, V, F)) {
-        std::cerr << "Failed to load OBJ file." << std::endl;
-        return;
-    }
-
-    // add triangles to world
-    for (int i = 0; i < F.rows(); ++i) {
-        vec3 translation(278, 10, 278);
-        double scale_factor = 4;
-
-        vec3 v0 = scale_factor * vec3(V(F(i, 0), 0), V(F(i, 0), 1), V(F(i, 0), 2)) + translation;
-        vec3 v1 = scale_factor * vec3(V(F(i, 1), 0), V(F(i, 1), 1), V(F(i, 1), 2)) + translation;
-        vec3 v2 = scale_factor * vec3(V(F(i, 2), 0), V(F(i, 2), 1), V(F(i, 2), 2)) + translation;
-
-        auto triangle = make_shared<Triangle>(v0, v1, v2, aluminum);
-
-        world.add(triangle);
-    }
+    auto mesh = load_obj_mesh("assets/bg8.obj", 4, vec3(278, 10, 278), aluminum);  // 替换为你的 OBJ 文件路径
+    if (!mesh) return;
+    world.add(mesh);
     // * ------------------------------
 
     camera cam;
@@ -791,49 +794,13 @@ void banner() {
     shared_ptr<material> aluminum = make_shared<metal>(color(0.8, 0.85, 0.88), 0.1);  // 金属材质
     shared_ptr<material> diffuse_tree = make_shared<lambertian>(color(0.2, 0.8, 0.2)); // 树的漫反射材质
 
-    Eigen::MatrixXd V_tree;
-    Eigen::MatrixXi F_tree;
-    std::string obj_file_path_tree = "assets/bg8.obj";  // 替换为你的树 OBJ 文件路径
-    if (!igl::readOBJ(obj_file_path_tree, V_tree, F_tree)) {
-        std::cerr << "Failed to load tree OBJ file." << std::endl;
-        return;
-    }
-
-    Eigen::MatrixXd V_metal;
-    Eigen::MatrixXi F_metal;
-    std::string obj_file_path_metal = "assets/tree5.obj";  // 替换为你的金属 OBJ 文件路径
-    if (!igl::readOBJ(obj_file_path_metal, V_metal, F_metal)) {
-        std::cerr << "Failed to load metal OBJ file." << std::endl;
-        return;
-    }
+    auto tree = load_obj_mesh("assets/bg8.obj", 4, vec3(278, 10, 278), diffuse_tree);  // 替换为你的树 OBJ 文件路径
+    auto metal_mesh = load_obj_mesh("assets/tree5.obj", 4, vec3(150, 20, 150), aluminum);  // 替换为你的金属 OBJ 文件路径
+    if (!tree || !metal_mesh) return;
+    world.add(tree);
+    world.add(metal_mesh);
 
-
-    for (int i = 0; i < F_tree.rows(); ++i) {
-        vec3 translation(278, 10, 278);
-        double scale_factor = 4;      
-
-        vec3 v0 = scale_factor * vec3(V_tree(F_tree(i, 0), 0), V_tree(F_tree(i, 0), 1), V_tree(F_tree(i, 0), 2)) + translation;
-        vec3 v1 = scale_factor * vec3(V_tree(F_tree(i, 1), 0), V_tree(F_tree(i, 1), 1), V_tree(F_tree(i, 1), 2)) + translation;
-        vec3 v2 = scale_factor * vec3(V_tree(F_tree(i, 2), 0), V_tree(F_tree(i, 2), 1), V_tree(F_tree(i, 2), 2)) + translation;
-
-        auto triangle = make_shared<Triangle>(v0, v1, v2, diffuse_tree);
-        world.add(triangle);
-    }
-
-
-    for (int i = 0; i < F_metal.rows(); ++i) {
-        vec3 translation(150, 20, 150);
-        double scale_factor = 4;
-
-
-        vec3 v0 = scale_factor * vec3(V_metal(F_metal(i, 0), 0), V_metal(F_metal(i, 0), 1), V_metal(F_metal(i, 0), 2)) + translation;
-        vec3 v1 = scale_factor * vec3(V_metal(F_metal(i, 1), 0), V_metal(F_metal(i, 1), 1), V_metal(F_metal(i, 1), 2)) + translation;
-        vec3 v2 = scale_factor * vec3(V_metal(F_metal(i, 2), 0), V_metal(F_metal(i, 2), 1), V_metal(F_metal(i, 2), 2)) + translation;
-
-
-        auto triangle = make_shared<Triangle>(v0, v1, v2, aluminum);
-        world.add(triangle);
-    }
+    world = hittable_list(make_shared<bvh_node>(world)); // * SAH bvh over both meshes
 
 
     camera cam;
@@ -863,8 +830,352 @@ void banner() {
     // cam.render_png(world, lights, "output/hdr_test2.png", gamma_value);
 }
 
+// * Forest of instanced trees: one tree5.obj mesh (the bottom-level bvh) placed thousands of
+// * times with random rotation and scale; the bvh_node over the instances is the top level.
+void forest() {
+    hittable_list world;
+
+    auto ground = make_shared<lambertian>(color(0.35, 0.30, 0.20));
+    world.add(make_shared<quad>(point3(-4000,0,-4000), vec3(8000,0,0), vec3(0,0,8000), ground));
+
+    auto tree = load_obj_mesh("assets/tree5.obj", 1, vec3(0,0,0), make_shared<lambertian>(color(0.15, 0.45, 0.12)));
+    if (!tree) return;
+
+    // a few trees get an autumn material instead of the mesh's own
+    auto autumn = make_shared<lambertian>(color(0.75, 0.35, 0.08));
+
+    hittable_list trees;
+    const int rows = 100, spacing = 60;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < rows; j++) {
+            point3 position((i - rows/2) * spacing + random_double(-20, 20), 0,
+                            (j - rows/2) * spacing + random_double(-20, 20));
+            affine3 placement = affine3::translation(position)
+                              * affine3::rotation_y(random_double(0, 360))
+                              * affine3::scaling(random_double(0.6, 1.2));
+            trees.add(make_shared<instance>(tree, placement, random_double() < 0.15 ? autumn : nullptr));
+        }
+    }
+    std::clog << "Forest: " << trees.objects.size() << " instances of " << tree->face_count()
+              << " triangles, " << tree->memory_bytes() / 1024 << " KiB of mesh data\n";
+    world.add(make_shared<bvh_node>(trees)); // * top-level bvh over the instances
+
+    // sun: a large area light high above the forest
+    auto sun = make_shared<diffuse_light>(color(6, 6, 5.5));
+    world.add(make_shared<quad>(point3(-1500,3000,-1500), vec3(3000,0,0), vec3(0,0,3000), sun));
+
+    hittable_list lights;
+    lights.add(make_shared<quad>(point3(-1500,3000,-1500), vec3(3000,0,0), vec3(0,0,3000), shared_ptr<material>()));
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 800;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 20;
+    cam.background        = color(0.70, 0.80, 1.00);
+
+    cam.vfov     = 35;
+    cam.lookfrom = point3(0, 400, -3400);
+    cam.lookat   = point3(0, 0, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render_mt(world, lights);
+}
+
+// * Thousands of small lights of different colours and strengths over a plaza: lamps facing
+// * down from a grid of posts, and glowing spheres on the ground (see light_sampler.h)
+void many_lights() {
+    hittable_list world;
+    hittable_list lights;
+    auto empty_material = shared_ptr<material>();
+
+    auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<quad>(point3(-1000,0,-1000), vec3(2000,0,0), vec3(0,0,2000), ground));
+
+    const int rows = 40, spacing = 25;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < rows; j++) {
+            point3 post((i - rows/2) * spacing, 0, (j - rows/2) * spacing);
+            double height = random_double(15, 30);
+
+            // lamp: a quad facing down, its strength spread over two orders of magnitude
+            auto lamp = make_shared<diffuse_light>(random_double(0.5, 50) * color(1, random_double(0.6, 1), random_double(0.3, 1)));
+            point3 corner = post + vec3(-1.5, height, -1.5);
+            world.add(make_shared<quad>(corner, vec3(3,0,0), vec3(0,0,3), lamp));
+            lights.add(make_shared<quad>(corner, vec3(3,0,0), vec3(0,0,3), empty_material));
+
+            // a post under every other lamp, a glowing sphere or a plain one between them
+            if ((i + j) % 2 == 0)
+                world.add(box(post + vec3(-0.5,0,-0.5), post + vec3(0.5,height,0.5), ground));
+            point3 between = post + vec3(spacing / 2.0, 2, spacing / 2.0);
+            if (random_double() < 0.3) {
+                auto glow = make_shared<diffuse_light>(random_double(1, 20) * color(random_double(0.2, 1), random_double(0.2, 1), 1));
+                world.add(make_shared<sphere>(between, 2, glow));
+                lights.add(make_shared<sphere>(between, 2, empty_material));
+            } else {
+                world.add(make_shared<sphere>(between, 2, make_shared<lambertian>(color::random(0.2, 0.9))));
+            }
+        }
+    }
+    std::clog << "Many lights: " << lights.objects.size() << " emitters\n";
+    world = hittable_list(make_shared<bvh_node>(world));
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 800;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 10;
+    cam.background        = color(0,0,0);
+
+    cam.vfov     = 50;
+    cam.lookfrom = point3(-300, 120, -520);
+    cam.lookat   = point3(0, 0, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render_mt(world, lights);
+}
+
+// * Trace the same random rays through the binary bvh_node and the 4-wide bvh4 and compare.
+void benchmark_bvh(const char* name, const hittable_list& objects, int num_rays) {
+    bvh_node binary(objects);
+    bvh4 wide(objects);
+
+    // rays start anywhere inside the scene and go in any direction (mostly incoherent)
+    aabb box = binary.bounding_box();
+    std::vector<ray> rays;
+    rays.reserve(num_rays);
+    for (int i = 0; i < num_rays; i++) {
+        point3 origin(random_double(box.x.min, box.x.max),
+                      random_double(box.y.min, box.y.max),
+                      random_double(box.z.min, box.z.max));
+        rays.emplace_back(origin, random_unit_vector(), random_double());
+    }
+
+    auto trace = [&](const hittable& bvh, double& checksum) {
+        checksum = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const auto& r : rays) {
+            hit_record rec;
+            if (bvh.hit(r, interval(0.001, infinity), rec))
+                checksum += rec.t;
+        }
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        return num_rays / seconds.count() / 1e6;
+    };
+
+    double sum_binary, sum_wide;
+    double mrays_binary = trace(binary, sum_binary);
+    double mrays_wide = trace(wide, sum_wide);
+
+    std::cerr << name << " (" << objects.objects.size() << " objects, " << num_rays << " rays)\n"
+              << "  bvh_node (binary): " << mrays_binary << " Mrays/s\n"
+              << "  bvh4 (4-wide):     " << mrays_wide << " Mrays/s  (x" << mrays_wide / mrays_binary << ")\n"
+              << "  results " << (sum_binary == sum_wide ? "match" : "DIFFER") << "\n";
+}
+
+void bvh_benchmark() {
+    const int num_rays = 1000000;
+
+    // * final_scene geometry: ground boxes, moving/static spheres and the sphere cluster
+    hittable_list final_objects;
+    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 20; j++) {
+            auto w = 100.0;
+            auto x0 = -1000.0 + i*w;
+            auto z0 = -1000.0 + j*w;
+            final_objects.add(box(point3(x0, 0, z0), point3(x0 + w, random_double(1,101), z0 + w), ground));
+        }
+    }
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    for (int j = 0; j < 1000; j++)
+        final_objects.add(make_shared<sphere>(point3::random(0,165) + vec3(-100,270,395), 10, white));
+    final_objects.add(make_shared<sphere>(point3(260, 150, 45), 50, white));
+    final_objects.add(make_shared<sphere>(point3(400,200,400), 100, white));
+    benchmark_bvh("final_scene", final_objects, num_rays);
+
+    // * triobj_test geometry: cornell walls and the tree mesh
+    hittable_list tree_objects;
+    tree_objects.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), white));
+    tree_objects.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), white));
+    tree_objects.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    tree_objects.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    tree_objects.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    Eigen::MatrixXd V;
+    Eigen::MatrixXi F;
+    if (!igl::readOBJ("assets/tree5.obj", V, F)) {
+        std::cerr << "Failed to load OBJ file." << std::endl;
+        return;
+    }
+    for (int i = 0; i < F.rows(); ++i) {
+        vec3 translation(278, 10, 278);
+        double scale_factor = 4;
+
+        vec3 v0 = scale_factor * vec3(V(F(i, 0), 0), V(F(i, 0), 1), V(F(i, 0), 2)) + translation;
+        vec3 v1 = scale_factor * vec3(V(F(i, 1), 0), V(F(i, 1), 1), V(F(i, 1), 2)) + translation;
+        vec3 v2 = scale_factor * vec3(V(F(i, 2), 0), V(F(i, 2), 1), V(F(i, 2), 2)) + translation;
+
+        tree_objects.add(make_shared<Triangle>(v0, v1, v2, white));
+    }
+    benchmark_bvh("triobj_test", tree_objects, num_rays);
+}
+
+
+// * "300", "300s", "5m" or "1.5h" -> seconds, -1 if malformed
+double parse_duration(const char* text) {
+    char* end = nullptr;
+    double value = std::strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    std::string unit(end);
+    if (unit.empty() || unit == "s") return value;
+    if (unit == "m") return value * 60;
+    if (unit == "h") return value * 3600;
+    return -1;
+}
+
+// * --output <file>          final image: .ppm (binary P6), .png, or linear HDR .pfm, .exr (half float)
+// *                           or .hdr (Radiance); default P6 on stdout
+// * --exr-compression <c>     none, rle or zip (default)
+// * --sampler <s>             sobol (default), halton or independent
+// * --time-limit <duration>   stop after the pass that would overrun the budget (implies --progressive)
+// * --progressive             render in passes, writing intermediate images
+// * --pass-samples <n>        samples per pixel added by each pass
+// * --progressive-output <f>  intermediate image path (P3 ppm)
+// * --spp <n>                 total samples per pixel of a progressive render (e.g. to top one up)
+// * --checkpoint <f>          save the progressive state to f periodically and at the end
+// * --checkpoint-interval <d> time between two checkpoints
+// * --resume                  continue from the --checkpoint file if there is one
+// * --denoise                 filter the final image, guided by first-hit albedo/normal/depth
+// * --aov <list>              AOVs to write next to the image: comma-separated names or "all"
+// * --aov-prefix <p>          AOV files are <p>.<name>.exr (default: the output file without extension)
+// * --packets <n>             trace camera rays in packets of 4, 8 or 16 (0: one by one, the default)
+// * --wavefront               trace breadth-first, shading the hits of each bounce by material kind
+// * --light-sampler <s>       light of each shadow ray: power (default), bvh or uniform
+bool parse_arguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--output" && has_value) {
+            camera_options.output_file = argv[++i];
+        } else if (arg == "--exr-compression" && has_value) {
+            std::string method = argv[++i];
+            if (method == "none") camera_options.output_compression = exr_compression::none;
+            else if (method == "rle") camera_options.output_compression = exr_compression::rle;
+            else if (method == "zip") camera_options.output_compression = exr_compression::zip;
+            else {
+                std::cerr << "Invalid EXR compression: " << method << " (none, rle or zip)\n";
+                return false;
+            }
+        } else if (arg == "--sampler" && has_value) {
+            std::string name = argv[++i];
+            if (name == "sobol") camera_options.sampler = sampler_type::sobol;
+            else if (name == "halton") camera_options.sampler = sampler_type::halton;
+            else if (name == "independent") camera_options.sampler = sampler_type::independent;
+            else {
+                std::cerr << "Invalid sampler: " << name << " (sobol, halton or independent)\n";
+                return false;
+            }
+        } else if (arg == "--progressive") {
+            camera_options.progressive = true;
+        } else if (arg == "--time-limit" && has_value) {
+            camera_options.time_limit = parse_duration(argv[++i]);
+            if (camera_options.time_limit <= 0) {
+                std::cerr << "Invalid time limit: " << argv[i] << " (use e.g. 300s, 5m, 1h)\n";
+                return false;
+            }
+            camera_options.progressive = true;
+        } else if (arg == "--pass-samples" && has_value) {
+            camera_options.pass_samples = std::atoi(argv[++i]);
+            if (camera_options.pass_samples < 1) {
+                std::cerr << "Invalid pass samples: " << argv[i] << "\n";
+                return false;
+            }
+        } else if (arg == "--progressive-output" && has_value) {
+            camera_options.progressive_output = argv[++i];
+        } else if (arg == "--spp" && has_value) {
+            camera_options.target_samples = std::atoi(argv[++i]);
+            if (camera_options.target_samples < 1) {
+                std::cerr << "Invalid samples per pixel: " << argv[i] << "\n";
+                return false;
+            }
+            camera_options.progressive = true;
+        } else if (arg == "--checkpoint" && has_value) {
+            camera_options.checkpoint_file = argv[++i];
+            camera_options.progressive = true;
+        } else if (arg == "--checkpoint-interval" && has_value) {
+            camera_options.checkpoint_interval = parse_duration(argv[++i]);
+            if (camera_options.checkpoint_interval < 0) {
+                std::cerr << "Invalid checkpoint interval: " << argv[i] << "\n";
+                return false;
+            }
+        } else if (arg == "--resume") {
+            camera_options.resume = true;
+            camera_options.progressive = true;
+        } else if (arg == "--denoise") {
+            camera_options.denoise = true;
+        } else if (arg == "--aov" && has_value) {
+            // comma-separated AOV names, or "all"
+            std::string list = argv[++i];
+            for (size_t start = 0; start <= list.size();) {
+                size_t end = std::min(list.find(',', start), list.size());
+                std::string name = list.substr(start, end - start);
+                aov_type type;
+                if (name == "all") {
+                    camera_options.aovs = (1u << aov_type_count) - 1;
+                } else if (aov_from_name(name, type)) {
+                    camera_options.aovs |= aov_bit(type);
+                } else {
+                    std::cerr << "Invalid AOV: " << name << " (depth, normal, albedo, emission, direct, indirect,"
+                              << " primitive_id, material_id, sample_count or all)\n";
+                    return false;
+                }
+                start = end + 1;
+            }
+        } else if (arg == "--aov-prefix" && has_value) {
+            camera_options.aov_prefix = argv[++i];
+        } else if (arg == "--wavefront") {
+            camera_options.wavefront = true;
+        } else if (arg == "--light-sampler" && has_value) {
+            std::string name = argv[++i];
+            if (name == "power") camera_options.light_sampling = light_selection::power;
+            else if (name == "bvh") camera_options.light_sampling = light_selection::bvh;
+            else if (name == "uniform") camera_options.light_sampling = light_selection::uniform;
+            else {
+                std::cerr << "Invalid light sampler: " << name << " (power, bvh or uniform)\n";
+                return false;
+            }
+        } else if (arg == "--packets" && has_value) {
+            camera_options.packet_size = std::atoi(argv[++i]);
+            int n = camera_options.packet_size;
+            if (n != 0 && n != 4 && n != 8 && n != 16) {
+                std::cerr << "Invalid packet size: " << argv[i] << " (0, 4, 8 or 16)\n";
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown or incomplete argument: " << arg << "\n"
+                      << "Usage: " << argv[0] << " [--output image.png|exr|hdr] [--exr-compression zip] [--sampler sobol] [--progressive] [--time-limit 300s] [--pass-samples N]"
+                      << " [--progressive-output file.ppm] [--spp N] [--checkpoint file]"
+                      << " [--checkpoint-interval 5m] [--resume] [--denoise]"
+                      << " [--aov depth,normal,...|all] [--aov-prefix path] [--packets 0|4|8|16] [--wavefront]"
+                      << " [--light-sampler power|bvh|uniform]\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main(int argc, char* argv[]) {
+    if (!parse_arguments(argc, argv))
+        return 1;
 
-int main() {
     // * start time record
     auto start = std::chrono::high_resolution_clock::now();
     
@@ -884,6 +1195,9 @@ int main() {
         case 12: hdr_test(); break;
         case 13: hdr_test2(); break;
         case 14: banner(); break;
+        case 15: bvh_benchmark(); break;
+        case 16: forest(); break;
+        case 17: many_lights(); break;
         default: final_scene(400, 250, 4); break;
     }
 
@@ -892,7 +1206,12 @@ int main() {
 
     // * calculate the duration
     std::chrono::duration<double, std::milli> duration = end - start;
-    std::cerr << "Rendering Time with BVH (basic, aabb): " << duration.count() << " ms\n";
+    std::cerr << "BVH build time: " << timings.bvh_build_ms << " ms\n";
+    std::cerr << "Render time: " << timings.render_ms << " ms\n";
+    std::cerr << "Total time (scene setup + BVH build + render): " << duration.count() << " ms\n";
+#ifdef RTW_COUNT_ALLOCATIONS
+    std::cerr << "Heap allocations while tracing: " << path_allocations.load() << "\n";
+#endif
 
     // * eigen test
     Eigen::Vector3d test(1.0, 2.0, 3.0);
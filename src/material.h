@@ -7,22 +7,51 @@
 
 #include "texture.h"
 
+#include <atomic>
+#include <type_traits>
+#include <variant>
+
 // class hit_record; // will be used in the material class
 
 
 class scatter_record {
   public:
     color attenuation;
-    shared_ptr<pdf> pdf_ptr;
+    // * the material's sampling pdf, stored inline so a scatter never allocates
+    // * (a material with a new kind of pdf adds it to this variant)
+    std::variant<std::monostate, cosine_pdf, sphere_pdf> pdf_storage;
     bool skip_pdf;
     ray skip_pdf_ray;
+
+    // the stored pdf, nullptr if none was set
+    const pdf* pdf_ptr() const {
+        return std::visit([](const auto& p) -> const pdf* {
+            if constexpr (std::is_same_v<std::decay_t<decltype(p)>, std::monostate>)
+                return nullptr;
+            else
+                return &p;
+        }, pdf_storage);
+    }
 };
 
+// * ids in creation order, like hittable::object_id (0 stands for the background)
+inline std::atomic<uint32_t> next_material_id{1};
+
+// * shading groups of the wavefront integrator (see wavefront.h), which shades the hits of
+// * one kind together
+enum class material_kind { lambertian, metal, dielectric, isotropic, light, other };
+
+constexpr int material_kind_count = 6;
+
 class material {
     public:
+        uint32_t material_id = next_material_id.fetch_add(1, std::memory_order_relaxed); // for the ID AOV
+
         // virtual
         virtual ~material() = default;
 
+        virtual material_kind kind() const { return material_kind::other; }
+
         virtual color emitted(
             const ray& r_in, const hit_record& rec, double u, double v, const point3& p
             ) const {
@@ -60,13 +89,15 @@ class lambertian : public material {
         // take a shared_ptr of texture
         lambertian(shared_ptr<texture> tex) : tex(tex) {}
 
+        material_kind kind() const override { return material_kind::lambertian; }
+
         // initialize the lambertian material with albedo
         // lambertian(const color& albedo) : albedo(albedo) {} // constructor with albedo
         
         bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec)
         const override {
             srec.attenuation = tex->value(rec.u, rec.v, rec.p);
-            srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+            srec.pdf_storage.emplace<cosine_pdf>(rec.normal);
             srec.skip_pdf = false;
             return true;
             // auto scatter_direction = rec.normal + random_unit_vector();
@@ -125,6 +156,8 @@ class metal : public material {
         // fuzziness is in 0 to 1
         metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
+        material_kind kind() const override { return material_kind::metal; }
+
         bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec)
         const override {
             vec3 reflected = reflect(r_in.direction(), rec.normal); // reflected ray
@@ -133,7 +166,7 @@ class metal : public material {
             // attenuation = albedo;
             // return (dot(scattered.direction(), rec.normal) > 0);
             srec.attenuation = albedo;
-            srec.pdf_ptr = nullptr;
+            srec.pdf_storage = std::monostate{};
             srec.skip_pdf = true;
             srec.skip_pdf_ray = ray(rec.p, reflected, r_in.time());
 
@@ -153,6 +186,8 @@ class dielectric : public material {
         // initialize the dielectric material with the refractive index
         dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
+        material_kind kind() const override { return material_kind::dielectric; }
+
         // * rewrite the scatter function, describe the scattering of the dielectric material (infact is refraction)
         bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec)
         const override {
@@ -160,7 +195,7 @@ class dielectric : public material {
             // attenuation = color(1.0, 1.0, 1.0); // 1 means no attenuation, means the material is transparent (glass, water, etc.)
 
             srec.attenuation = color(1.0, 1.0, 1.0);
-            srec.pdf_ptr = nullptr;
+            srec.pdf_storage = std::monostate{};
             srec.skip_pdf = true;
 
             // Determine the value of the refraction index based on the relationship between the light ray and the surface normal
@@ -216,6 +251,8 @@ class diffuse_light : public  material {
         // * constructor for color, create a solid color texture
         diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
 
+        material_kind kind() const override { return material_kind::light; }
+
         // * emiited function, returns the emission color of the material at the given point
         color emitted(
             const ray& r_in, const hit_record& rec, double u, double v, const point3& p
@@ -238,6 +275,8 @@ class isotropic : public material {
     // Constructor that initializes the texture with a given texture
     isotropic(shared_ptr<texture> tex) : tex(tex) {}
 
+    material_kind kind() const override { return material_kind::isotropic; }
+
     // Scatter function: simulates isotropic scattering
     bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec)
     const override {
@@ -248,7 +287,7 @@ class isotropic : public material {
         // attenuation = tex->value(rec.u, rec.v, rec.p);
         // pdf = 1.0 / (4 * pi); // Set the PDF value to 1/(4*pi) for isotropic scattering
         srec.attenuation = tex->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<sphere_pdf>();
+        srec.pdf_storage.emplace<sphere_pdf>();
         srec.skip_pdf = false;
         return true;
     }
@@ -75,10 +75,12 @@ class hittable_pdf : public pdf {
 
 
 // Mixture PDF class that combines two different PDFs
+// * It only points at its two PDFs (which live on the caller's stack or in a scatter_record),
+// * so building one per bounce costs no heap allocation or reference counting.
 class mixture_pdf : public pdf {
   public:
-    // Constructor: Takes two shared pointers to pdf objects
-    mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
+    // Constructor: Takes two pointers to pdf objects, which must outlive the mixture
+    mixture_pdf(const pdf* p0, const pdf* p1) {
         p[0] = p0;  // Assign the first PDF
         p[1] = p1;  // Assign the second PDF
     }
@@ -99,8 +101,16 @@ class mixture_pdf : public pdf {
     }
 
   private:
-    shared_ptr<pdf> p[2];  // Array of two PDFs to combine
+    const pdf* p[2];  // Array of two PDFs to combine (not owned)
 };
 
 
+// * Multiple importance sampling weight (Veach's power heuristic, exponent 2) of a sample drawn
+// * with density pdf_drawn, when another strategy could have drawn it with density pdf_other
+inline double power_heuristic(double pdf_drawn, double pdf_other) {
+    double a = pdf_drawn * pdf_drawn, b = pdf_other * pdf_other;
+    return a > 0 ? a / (a + b) : 0;
+}
+
+
 #endif
\ No newline at end of file
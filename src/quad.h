@@ -39,40 +39,27 @@ class quad : public hittable {
 
         // hit detection
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            auto denom = dot(normal, r.direction()); // * denominator of the ray-plane intersection
-
-            // No hit if the ray is parallel to the plane
-            if (std::fabs(denom) < 1e-8) return false;
-
-            // return false if the hit point parameter t is outside the ray interval
-            auto t = (D - dot(normal, r.origin())) / denom;
-            if(!ray_t.contains(t)) return false;
-
-            // * Determine if the hit point lies within the planar shape using its plane coordinates.
-
-            auto intersection = r.at(t); // * intersection point
-
-            vec3 planar_hitpt_vector = intersection - Q; // * vector from the origin of the quad to the hit point
-
-            // calculate alpha and beta for checking if the hit point lies within the quad
-            auto alpha = dot(w, cross(planar_hitpt_vector, v));
-            auto beta = dot(w, cross(u, planar_hitpt_vector));
+            double t, alpha, beta;
+            point3 intersection;
+            if (!hit_plane(r, ray_t, t, intersection, alpha, beta)) return false;
 
             if(!is_interior(alpha, beta, rec)) return false; // return false if the hit point is not in the interior
 
-
-            // * if hit the 2D plane
-            // auto intersection = r.at(t); // * intersection point
-
             // * Ray hits the 2D shape; set the rest of the hit record and return true
             rec.t = t;
             rec.p = intersection;
-            rec.mat = mat;
+            rec.mat = mat.get();
+            rec.primitive_id = object_id;
             rec.set_face_normal(r, normal);
 
             return true;
         }
 
+        bool occluded(const ray& r, interval ray_t) const override {
+            double t;
+            return hit_distance(r, ray_t, t);
+        }
+
         virtual bool is_interior(double a, double b, hit_record& rec) const {
             // Given the hit point in plane coordinates, return false if it is outside the
             // primitive, otherwise set the hit record UV coordinates and return true.
@@ -89,15 +76,16 @@ class quad : public hittable {
 
         // Override the pdf_value function to calculate the probability density function value
         double pdf_value(const point3& origin, const vec3& direction) const override {
-            hit_record rec;
+            double t;
             // Check if the ray from origin in the given direction hits the quad
-            if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            if (!hit_distance(ray(origin, direction), interval(0.001, infinity), t))
                 return 0;
 
             // Calculate the square of the distance from the origin to the hit point
-            auto distance_squared = rec.t * rec.t * direction.length_squared();
+            auto distance_squared = t * t * direction.length_squared();
             // Calculate the cosine of the angle between the direction and the normal at the hit point
-            auto cosine = std::fabs(dot(direction, rec.normal) / direction.length());
+            // (the sign of the face normal does not matter here)
+            auto cosine = std::fabs(dot(direction, normal) / direction.length());
 
             // Return the PDF value based on distance, cosine, and the area of the quad
             return distance_squared / (cosine * area);
@@ -106,7 +94,9 @@ class quad : public hittable {
         // Override the random function to generate a random point on the quad relative to the origin
         vec3 random(const point3& origin) const override {
             // Randomly select a point on the quad using u and v vectors
-            auto p = Q + (random_double() * u) + (random_double() * v);
+            double a, b;
+            random_double_2d(a, b);
+            auto p = Q + (a * u) + (b * v);
             return p - origin; // Return the vector from the origin to the random point on the quad
         }
 
@@ -122,6 +112,37 @@ class quad : public hittable {
         double D;
         
         double area;
+
+        // * where r meets the plane of the quad inside ray_t: the distance, the point and its
+        // * plane coordinates (alpha along u, beta along v)
+        bool hit_plane(const ray& r, interval ray_t, double& t, point3& intersection,
+                       double& alpha, double& beta) const {
+            auto denom = dot(normal, r.direction()); // * denominator of the ray-plane intersection
+
+            // No hit if the ray is parallel to the plane
+            if (std::fabs(denom) < 1e-8) return false;
+
+            // return false if the hit point parameter t is outside the ray interval
+            t = (D - dot(normal, r.origin())) / denom;
+            if(!ray_t.contains(t)) return false;
+
+            // * Determine if the hit point lies within the planar shape using its plane coordinates.
+            intersection = r.at(t); // * intersection point
+            vec3 planar_hitpt_vector = intersection - Q; // * vector from the origin of the quad to the hit point
+
+            // calculate alpha and beta for checking if the hit point lies within the quad
+            alpha = dot(w, cross(planar_hitpt_vector, v));
+            beta = dot(w, cross(u, planar_hitpt_vector));
+            return true;
+        }
+
+        // * distance to a hit inside ray_t, without a hit record
+        bool hit_distance(const ray& r, interval ray_t, double& t) const {
+            double alpha, beta;
+            point3 intersection;
+            hit_record uv; // is_interior only writes the uv coordinates
+            return hit_plane(r, ray_t, t, intersection, alpha, beta) && is_interior(alpha, beta, uv);
+        }
 };
 
 // * 3D box (axis-aligned)
@@ -0,0 +1,207 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "rtweekend.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+class hittable;
+
+// * Up to 16 rays traced together (camera rays of neighbouring pixels), in SoA layout so one
+// SIMD instruction handles several rays. Box tests run in float, 8 rays per AVX step;
+// primitive tests run in double, 4 rays per step, with the same formulas as the scalar hit().
+// A packet only finds, per ray, the closest hit distance and the object that produced it;
+// the hit record is then filled by that object's scalar hit() in a tight interval around the
+// distance (see hit_interval), so shading sees exactly what single rays see.
+struct alignas(32) ray_packet {
+    static constexpr int max_size = 16;
+
+    int size = 0;                 // rays in the packet; lanes [size, max_size) are unused
+    double t_min = 0;             // near limit shared by all rays
+    alignas(32) double origin[3][max_size];
+    alignas(32) double direction[3][max_size];
+    alignas(32) double time[max_size];
+    alignas(32) double t_max[max_size];  // closest hit so far (the far limit)
+
+    // float copies for the box tests; t_far is rounded up and -inf on unused lanes
+    alignas(32) float origin_f[3][max_size];
+    alignas(32) float inv_direction_f[3][max_size];
+    alignas(32) float t_far[max_size];
+
+    const hittable* closest[max_size]; // object to ask for the hit record, null while nothing was hit
+    bool retrace[max_size];            // the closest hit is not known, trace the lane as a single ray
+
+    ray_packet() = default;
+
+    ray_packet(const ray* rays, int count, interval ray_t) : size(count), t_min(ray_t.min) {
+        for (int l = 0; l < max_size; l++) {
+            const ray& r = rays[l < count ? l : 0]; // unused lanes copy lane 0, their t_far keeps them out
+            for (int a = 0; a < 3; a++) {
+                origin[a][l] = r.origin()[a];
+                direction[a][l] = r.direction()[a];
+                origin_f[a][l] = float(r.origin()[a]);
+                inv_direction_f[a][l] = float(1.0 / r.direction()[a]);
+            }
+            time[l] = r.time();
+            t_max[l] = ray_t.max;
+            t_far[l] = l < count ? round_up(ray_t.max) : -std::numeric_limits<float>::infinity();
+            closest[l] = nullptr;
+            retrace[l] = false;
+        }
+    }
+
+    uint32_t lanes() const { return (1u << size) - 1; }
+
+    ray lane_ray(int l) const {
+        return ray(point3(origin[0][l], origin[1][l], origin[2][l]),
+                   vec3(direction[0][l], direction[1][l], direction[2][l]), time[l]);
+    }
+
+    // * a closer hit for lane l
+    void record_hit(int l, double t, const hittable* object) {
+        t_max[l] = t;
+        t_far[l] = round_up(t);
+        closest[l] = object;
+        retrace[l] = false;
+    }
+
+    // * lane l has to be traced again as a single ray, up to t: an object there (a volume)
+    // * cannot decide its hit once and for all from the packet
+    void record_retrace(int l, double t) {
+        record_hit(l, t, nullptr);
+        retrace[l] = true;
+    }
+
+    // * interval in which closest[l]'s own hit() finds the recorded hit again
+    interval hit_interval(int l) const {
+        double slack = 1e-9 * std::fabs(t_max[l]) + 1e-12;
+        return interval(std::fmax(t_min, t_max[l] - slack), t_max[l] + slack);
+    }
+
+    // * Slab test of one box against the lanes in `lanes`; returns the lanes that hit it.
+    // The far distance is widened by 3 float roundings (as in pbrt), so float arithmetic never
+    // rejects a box the double test would accept.
+    uint32_t hit_box(const float bounds_min[3], const float bounds_max[3], uint32_t lanes) const {
+        constexpr float widen = 1.0f + 6.0f * std::numeric_limits<float>::epsilon();
+        uint32_t mask = 0;
+#if defined(__AVX__)
+        for (int base = 0; base < size; base += 8) {
+            if (!((lanes >> base) & 0xff)) continue;
+            __m256 near = _mm256_set1_ps(float(t_min));
+            __m256 far = _mm256_load_ps(&t_far[base]);
+            for (int a = 0; a < 3; a++) {
+                __m256 o = _mm256_load_ps(&origin_f[a][base]);
+                __m256 inv = _mm256_load_ps(&inv_direction_f[a][base]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds_min[a]), o), inv);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds_max[a]), o), inv);
+                // max/min return their second operand on NaN (0 * inf), keeping the current interval
+                near = _mm256_max_ps(_mm256_min_ps(t0, t1), near);
+                far = _mm256_min_ps(_mm256_mul_ps(_mm256_max_ps(t0, t1), _mm256_set1_ps(widen)), far);
+            }
+            mask |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ))) << base;
+        }
+#else
+        for (int l = 0; l < size; l++) {
+            if (!(lanes & (1u << l))) continue;
+            float near = float(t_min), far = t_far[l];
+            for (int a = 0; a < 3; a++) {
+                float t0 = (bounds_min[a] - origin_f[a][l]) * inv_direction_f[a][l];
+                float t1 = (bounds_max[a] - origin_f[a][l]) * inv_direction_f[a][l];
+                if (t0 > t1) std::swap(t0, t1);
+                near = t0 > near ? t0 : near;
+                far = t1 * widen < far ? t1 * widen : far;
+            }
+            if (near <= far) mask |= 1u << l;
+        }
+#endif
+        return mask & lanes;
+    }
+
+    static float round_up(double t) {
+        float f = float(t);
+        return double(f) < t ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+
+// * Moller-Trumbore test of one triangle against the lanes in `lanes` (same arithmetic as
+// * Triangle::hit); every lane that hits it closer than its t_max records `object`.
+inline void packet_hit_triangle(ray_packet& packet, uint32_t lanes, const point3& v0,
+                                const vec3& edge1, const vec3& edge2, const hittable* object) {
+#if defined(__AVX__)
+    for (int base = 0; base < packet.size; base += 4) {
+        if (!((lanes >> base) & 0xf)) continue;
+        __m256d dx = _mm256_load_pd(&packet.direction[0][base]);
+        __m256d dy = _mm256_load_pd(&packet.direction[1][base]);
+        __m256d dz = _mm256_load_pd(&packet.direction[2][base]);
+
+        // h = cross(d, edge2), a = dot(edge1, h)
+        __m256d hx = _mm256_sub_pd(_mm256_mul_pd(dy, _mm256_set1_pd(edge2.z())), _mm256_mul_pd(dz, _mm256_set1_pd(edge2.y())));
+        __m256d hy = _mm256_sub_pd(_mm256_mul_pd(dz, _mm256_set1_pd(edge2.x())), _mm256_mul_pd(dx, _mm256_set1_pd(edge2.z())));
+        __m256d hz = _mm256_sub_pd(_mm256_mul_pd(dx, _mm256_set1_pd(edge2.y())), _mm256_mul_pd(dy, _mm256_set1_pd(edge2.x())));
+        __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(edge1.x()), hx),
+                                                _mm256_mul_pd(_mm256_set1_pd(edge1.y()), hy)),
+                                  _mm256_mul_pd(_mm256_set1_pd(edge1.z()), hz));
+        __m256d abs_a = _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+        __m256d valid = _mm256_cmp_pd(abs_a, _mm256_set1_pd(1e-8), _CMP_GE_OQ);
+        __m256d f = _mm256_div_pd(_mm256_set1_pd(1.0), a);
+
+        // s = origin - v0, u = f * dot(s, h)
+        __m256d sx = _mm256_sub_pd(_mm256_load_pd(&packet.origin[0][base]), _mm256_set1_pd(v0.x()));
+        __m256d sy = _mm256_sub_pd(_mm256_load_pd(&packet.origin[1][base]), _mm256_set1_pd(v0.y()));
+        __m256d sz = _mm256_sub_pd(_mm256_load_pd(&packet.origin[2][base]), _mm256_set1_pd(v0.z()));
+        __m256d u = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, hx), _mm256_mul_pd(sy, hy)),
+                                                   _mm256_mul_pd(sz, hz)));
+        valid = _mm256_and_pd(valid, _mm256_cmp_pd(u, _mm256_setzero_pd(), _CMP_GE_OQ));
+        valid = _mm256_and_pd(valid, _mm256_cmp_pd(u, _mm256_set1_pd(1.0), _CMP_LE_OQ));
+
+        // q = cross(s, edge1), v = f * dot(d, q), t = f * dot(edge2, q)
+        __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, _mm256_set1_pd(edge1.z())), _mm256_mul_pd(sz, _mm256_set1_pd(edge1.y())));
+        __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, _mm256_set1_pd(edge1.x())), _mm256_mul_pd(sx, _mm256_set1_pd(edge1.z())));
+        __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, _mm256_set1_pd(edge1.y())), _mm256_mul_pd(sy, _mm256_set1_pd(edge1.x())));
+        __m256d v = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+                                                   _mm256_mul_pd(dz, qz)));
+        valid = _mm256_and_pd(valid, _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_GE_OQ));
+        valid = _mm256_and_pd(valid, _mm256_cmp_pd(_mm256_add_pd(u, v), _mm256_set1_pd(1.0), _CMP_LE_OQ));
+
+        __m256d t = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(
+            _mm256_mul_pd(_mm256_set1_pd(edge2.x()), qx), _mm256_mul_pd(_mm256_set1_pd(edge2.y()), qy)),
+            _mm256_mul_pd(_mm256_set1_pd(edge2.z()), qz)));
+        valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, _mm256_set1_pd(packet.t_min), _CMP_GT_OQ));
+        valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, _mm256_load_pd(&packet.t_max[base]), _CMP_LT_OQ));
+
+        int hits = _mm256_movemask_pd(valid) & int((lanes >> base) & 0xf);
+        if (!hits) continue;
+        alignas(32) double t_lane[4];
+        _mm256_store_pd(t_lane, t);
+        for (int k = 0; k < 4; k++)
+            if (hits & (1 << k)) packet.record_hit(base + k, t_lane[k], object);
+    }
+#else
+    for (int l = 0; l < packet.size; l++) {
+        if (!(lanes & (1u << l))) continue;
+        vec3 d(packet.direction[0][l], packet.direction[1][l], packet.direction[2][l]);
+        vec3 h = cross(d, edge2);
+        double a = dot(edge1, h);
+        if (a > -1e-8 && a < 1e-8) continue;
+        double f = 1.0 / a;
+        vec3 s = point3(packet.origin[0][l], packet.origin[1][l], packet.origin[2][l]) - v0;
+        double u = f * dot(s, h);
+        if (u < 0.0 || u > 1.0) continue;
+        vec3 q = cross(s, edge1);
+        double v = f * dot(d, q);
+        if (v < 0.0 || u + v > 1.0) continue;
+        double t = f * dot(edge2, q);
+        if (t > packet.t_min && t < packet.t_max[l])
+            packet.record_hit(l, t, object);
+    }
+#endif
+}
+
+#endif
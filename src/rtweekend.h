@@ -1,7 +1,9 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -16,16 +18,27 @@ using std::make_shared;
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
+// * Wall-clock time spent in each phase, printed by main()
+struct render_timings {
+    double bvh_build_ms = 0; // accumulated over every bvh_node built
+    double render_ms = 0;    // accumulated over every camera render call
+};
+
+inline render_timings timings;
+
+// * Heap allocation counters. They only count when built with RTW_COUNT_ALLOCATIONS, which
+// makes main.cpp replace the global operator new.
+inline thread_local uint64_t thread_allocations = 0; // operator new calls made by this thread
+inline std::atomic<uint64_t> path_allocations{0};    // calls made while tracing camera samples
+
 // * Utility Functions
 
 inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline double random_double() {
-    // Returns a random real in [0, 1).
-    return std::rand() / (RAND_MAX + 1.0);
-}
+// * Random numbers: per-thread counter-based RNG and low-discrepancy samplers (random_double)
+#include "sampler.h"
 
 inline double random_double(double min, double max) {
     // Returns a random real in [min, max).
@@ -0,0 +1,208 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+// * Per-thread sampler behind random_double()
+// Each random number is a pure function of (pixel, sample index, dimension): keys and indices
+// are hashed or scrambled instead of advancing a shared state like std::rand(). Threads never
+// touch each other's state, and the image does not depend on which thread rendered which pixel.
+//
+// Dimensions come in blocks of sampler_block_dimensions: block 0 is the camera ray (pixel
+// position, lens, time), block b the path vertex of bounce b. Draws within a block take
+// consecutive dimensions; draws past its end (long rejection loops) fall back to the
+// independent hash, so they never reuse a dimension of the same sample.
+
+enum class sampler_type {
+    independent, // hashed white noise (the camera stratifies the pixel area itself)
+    halton,      // radical inverses in prime bases, digit-scrambled per pixel and dimension
+    sobol        // Owen-scrambled Sobol (0,2)-sequence pairs, index-shuffled per pair (padding)
+};
+
+constexpr uint32_t sampler_block_dimensions = 8;
+
+struct rng_state {
+    uint64_t key = 0x853c49e6748fea9bULL; // derived from the (pixel, sample) pair
+    uint64_t counter = 0;                 // high 32 bits: bounce, low 32 bits: draw within bounce
+
+    sampler_type type = sampler_type::independent;
+    uint64_t pixel_seed = 0;              // scrambling seed of the low-discrepancy samplers
+    uint32_t index = 0;                   // sample index within the pixel
+    uint32_t reversed_index = 0;          // the same, bit-reversed (Sobol works on reversed bits)
+    uint32_t dimension = 0;               // next low-discrepancy dimension
+    uint32_t dimension_end = 0;           // end of the current block
+    double pair_second = 0;               // Sobol: second value of the pair drawn last
+};
+
+inline thread_local rng_state thread_rng;
+
+inline uint64_t splitmix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+// * Owen-scrambled Sobol (Burley 2020, "Practical Hash-based Owen Scrambling")
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = __builtin_bswap32(x);
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    return ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+}
+
+// hash in which every bit only depends on the bits below it: an Owen scramble of reversed bits
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// 32-bit integer hash (lowbias32)
+inline uint32_t hash32(uint32_t x) {
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    return x ^ (x >> 16);
+}
+
+// * Second Sobol dimension (the Pascal matrix over GF(2), partner of van der Corput), on
+// bit-reversed input and output. It is linear in the bits, so it is the xor of four per-byte
+// tables instead of a 32-step loop.
+struct sobol_pascal_tables {
+    uint32_t byte[4][256];
+
+    constexpr sobol_pascal_tables() : byte{} {
+        uint32_t column[32] = {};
+        for (uint32_t k = 0, v = 1u << 31; k < 32; k++, v ^= v >> 1) {
+            uint32_t reversed = 0; // image of index bit k, bit-reversed
+            for (int b = 0; b < 32; b++)
+                if (v & (1u << b)) reversed |= 1u << (31 - b);
+            column[31 - k] = reversed; // input bit k sits at 31 - k after reversal
+        }
+        for (int b = 0; b < 4; b++)
+            for (uint32_t value = 0; value < 256; value++)
+                for (int k = 0; k < 8; k++)
+                    if (value & (1u << k)) byte[b][value] ^= column[8 * b + k];
+    }
+};
+
+inline constexpr sobol_pascal_tables sobol_pascal{};
+
+// * Dimension pairs (0,1), (2,3), ... each get their own Owen-scrambled shuffle of the sample
+// * index, so every pair is a well-stratified 2D set and different pairs are uncorrelated.
+// In bit-reversed form the shuffle, both Sobol dimensions and the final scramble chain up with
+// few reversals: reversed_index is reverse_bits(sample index). Both values of the pair are
+// computed together, they share the shuffle.
+inline void sobol_owen_pair(uint32_t reversed_index, uint32_t pair, uint64_t pixel_seed,
+                            double& first, double& second) {
+    uint64_t pair_seed = splitmix64(pixel_seed ^ (0x9e3779b97f4a7c15ULL * pair));
+    uint32_t y = laine_karras_permutation(reversed_index, uint32_t(pair_seed)); // shuffled index, reversed
+    uint32_t scramble_seed = hash32(uint32_t(pair_seed >> 32));
+
+    // reversed Sobol points: van der Corput's is the index itself, the other one a table lookup
+    uint32_t point0 = reverse_bits(y);
+    uint32_t point1 = sobol_pascal.byte[0][y & 0xff] ^ sobol_pascal.byte[1][(y >> 8) & 0xff]
+                    ^ sobol_pascal.byte[2][(y >> 16) & 0xff] ^ sobol_pascal.byte[3][y >> 24];
+
+    first  = reverse_bits(laine_karras_permutation(point0, scramble_seed)) * 0x1.0p-32;
+    second = reverse_bits(laine_karras_permutation(point1, scramble_seed ^ 0x9e3779b9u)) * 0x1.0p-32;
+}
+
+
+// * Randomized Halton: the radical inverse of the index in the dimension's prime base, with
+// every digit d replaced by (a * d + c) mod base for hashed a != 0, c (a random linear digit
+// scramble). The digits beyond the index are scrambled zeros, i.e. uniform: they are added as
+// one uniform offset instead of digit by digit.
+
+constexpr uint32_t halton_dimensions = 64;
+
+inline constexpr uint16_t halton_primes[halton_dimensions] = {
+      2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+     59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+
+inline double halton_scrambled(uint32_t index, uint32_t dimension, uint64_t pixel_seed) {
+    const uint32_t base = halton_primes[dimension];
+    const double inv_base = 1.0 / base;
+    uint64_t seed = splitmix64(pixel_seed ^ (0xd1b54a32d192ed03ULL * (dimension + 1)));
+
+    double result = 0, factor = inv_base;
+    for (uint64_t digit = 0; index > 0; digit++) {
+        uint64_t h = splitmix64(seed + digit);
+        uint32_t a = base == 2 ? 1 : 1 + uint32_t(h % (base - 1));
+        uint32_t c = uint32_t((h >> 32) % base);
+        uint32_t d = index % base;
+        index /= base;
+        result += ((a * d + c) % base) * factor;
+        factor *= inv_base;
+    }
+    // tail of uniformly scrambled zero digits, worth at most base * factor
+    double tail = (splitmix64(seed ^ 0x5851f42d4c957f2dULL) >> 11) * 0x1.0p-53;
+    result += tail * factor * base;
+    return result < 1.0 ? result : 0x1.fffffffffffffp-1;
+}
+
+
+inline void rng_start_sample(uint64_t pixel_index, uint64_t sample_index,
+                             sampler_type type = sampler_type::independent) {
+    // Select the random stream of one camera sample
+    uint64_t pixel_hash = splitmix64(pixel_index + 0x9e3779b97f4a7c15ULL);
+    thread_rng.key = splitmix64(pixel_hash ^ sample_index);
+    thread_rng.counter = 0;
+
+    thread_rng.type = type;
+    thread_rng.pixel_seed = pixel_hash;
+    thread_rng.index = uint32_t(sample_index);
+    thread_rng.reversed_index = reverse_bits(uint32_t(sample_index));
+    thread_rng.dimension = 0;
+    thread_rng.dimension_end = sampler_block_dimensions;
+}
+
+inline void rng_start_bounce(int bounce) {
+    // Jump to the dimensions of the given path vertex, so a variable number of draws in one
+    // bounce (e.g. rejection sampling) never shifts the numbers used by the next one
+    thread_rng.counter = uint64_t(bounce) << 32;
+    thread_rng.dimension = uint32_t(bounce) * sampler_block_dimensions;
+    thread_rng.dimension_end = thread_rng.dimension + sampler_block_dimensions;
+}
+
+inline uint64_t random_u64() {
+    return splitmix64(thread_rng.key + 0x9e3779b97f4a7c15ULL * ++thread_rng.counter);
+}
+
+inline double random_double() {
+    // Returns a random real in [0, 1).
+    rng_state& s = thread_rng;
+    if (s.type != sampler_type::independent && s.dimension < s.dimension_end) {
+        if (s.type == sampler_type::sobol) {
+            uint32_t d = s.dimension++;
+            // dimensions only ever jump to even values (block starts, random_double_2d), so an
+            // odd one always comes right after the first value of its pair
+            if (d & 1) return s.pair_second;
+            double first;
+            sobol_owen_pair(s.reversed_index, d >> 1, s.pixel_seed, first, s.pair_second);
+            return first;
+        }
+        if (s.dimension < halton_dimensions)
+            return halton_scrambled(s.index, s.dimension++, s.pixel_seed);
+    }
+    return (random_u64() >> 11) * 0x1.0p-53;
+}
+
+// * Two random reals in [0, 1) used as one 2D point (a pixel position, a direction). The
+// * low-discrepancy samplers take them from an aligned dimension pair, which is stratified in 2D.
+inline void random_double_2d(double& u1, double& u2) {
+    rng_state& s = thread_rng;
+    if (s.type != sampler_type::independent)
+        s.dimension = (s.dimension + 1) & ~1u;
+    u1 = random_double();
+    u2 = random_double();
+}
+
+#endif
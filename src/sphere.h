@@ -4,6 +4,10 @@
 #include "hittable.h"
 #include "onb.h"  // Include for Orthonormal Basis (ONB) transformations
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
 // Sphere class that inherits from the hittable class
 class sphere : public hittable {
   public:
@@ -37,28 +41,9 @@ class sphere : public hittable {
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // Get the current center of the sphere based on the time of the ray
         point3 current_center = center.at(r.time());
-        // Compute the vector from the ray's origin to the sphere's center
-        vec3 oc = current_center - r.origin();
-        // Compute quadratic coefficients for the sphere-ray intersection
-        auto a = r.direction().length_squared(); // The squared length of the ray direction
-        auto h = dot(r.direction(), oc);         // Projection of oc on the ray direction
-        auto c = oc.length_squared() - radius*radius; // Difference between oc squared and radius squared
-
-        // Calculate the discriminant to check if the ray intersects the sphere
-        auto discriminant = h*h - a*c;
-        if (discriminant < 0)
-            return false; // No intersection if the discriminant is negative
-
-        // Calculate the square root of the discriminant (used to find the roots)
-        auto sqrtd = std::sqrt(discriminant);
-
-        // Find the nearest root within the acceptable range
-        auto root = (h - sqrtd) / a;
-        if (!ray_t.surrounds(root)) {  // If the root is not in the range, try the other root
-            root = (h + sqrtd) / a;
-            if (!ray_t.surrounds(root))
-                return false; // If both roots are out of range, return false (no hit)
-        }
+        double root;
+        if (!intersect(r, current_center, ray_t, root))
+            return false;
 
         // If we have a valid root, update the hit record
         rec.t = root; // Record the hit time
@@ -67,21 +52,75 @@ class sphere : public hittable {
         vec3 outward_normal = (rec.p - current_center) / radius;
         rec.set_face_normal(r, outward_normal); // Adjust normal direction depending on the ray
         get_sphere_uv(outward_normal, rec.u, rec.v); // Calculate texture UV coordinates
-        rec.mat = mat; // Assign the material to the hit record
+        rec.mat = mat.get(); // Assign the material to the hit record
+        rec.primitive_id = object_id;
 
         return true; // Return true indicating a hit
     }
 
+    // * the scalar test above for 4 rays at a time (AVX), each at its own time
+    void hit_packet(ray_packet& packet, uint32_t lanes) const override {
+#if defined(__AVX__)
+        const __m256d radius_squared = _mm256_set1_pd(radius*radius);
+        for (int base = 0; base < packet.size; base += 4) {
+            if (!((lanes >> base) & 0xf)) continue;
+            __m256d time = _mm256_load_pd(&packet.time[base]);
+            __m256d oc[3], d[3];
+            for (int k = 0; k < 3; k++) {
+                __m256d c = _mm256_add_pd(_mm256_set1_pd(center.origin()[k]),
+                                          _mm256_mul_pd(time, _mm256_set1_pd(center.direction()[k])));
+                oc[k] = _mm256_sub_pd(c, _mm256_load_pd(&packet.origin[k][base]));
+                d[k] = _mm256_load_pd(&packet.direction[k][base]);
+            }
+            auto dot3 = [](const __m256d* x, const __m256d* y) {
+                return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x[0], y[0]), _mm256_mul_pd(x[1], y[1])),
+                                     _mm256_mul_pd(x[2], y[2]));
+            };
+            __m256d a = dot3(d, d);
+            __m256d h = dot3(d, oc);
+            __m256d c = _mm256_sub_pd(dot3(oc, oc), radius_squared);
+            __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+            __m256d valid = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+            if (!_mm256_movemask_pd(valid)) continue;
+
+            __m256d sqrtd = _mm256_sqrt_pd(discriminant);
+            __m256d t_min = _mm256_set1_pd(packet.t_min);
+            __m256d t_max = _mm256_load_pd(&packet.t_max[base]);
+            // nearest root inside (t_min, t_max), else the far one
+            __m256d near_root = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+            __m256d far_root = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+            __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_root, t_min, _CMP_GT_OQ),
+                                            _mm256_cmp_pd(near_root, t_max, _CMP_LT_OQ));
+            __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_root, t_min, _CMP_GT_OQ),
+                                           _mm256_cmp_pd(far_root, t_max, _CMP_LT_OQ));
+            __m256d root = _mm256_blendv_pd(far_root, near_root, near_ok);
+            valid = _mm256_and_pd(valid, _mm256_or_pd(near_ok, far_ok));
+
+            int hits = _mm256_movemask_pd(valid) & int((lanes >> base) & 0xf);
+            if (!hits) continue;
+            alignas(32) double t[4];
+            _mm256_store_pd(t, root);
+            for (int k = 0; k < 4; k++)
+                if (hits & (1 << k)) packet.record_hit(base + k, t[k], this);
+        }
+#else
+        hittable::hit_packet(packet, lanes);
+#endif
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        double root;
+        return intersect(r, center.at(r.time()), ray_t, root);
+    }
+
     // Function to return the axis-aligned bounding box of the sphere
     aabb bounding_box() const override { return bbox; }
 
     // Function to calculate the probability density function (PDF) value
     // This is used to determine how likely a direction is to hit the sphere
     double pdf_value(const point3& origin, const vec3& direction) const override {
-        // Create a temporary hit record
-        hit_record rec;
         // Cast a ray from the origin in the given direction and check for hits
-        if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+        if (!occluded(ray(origin, direction), interval(0.001, infinity)))
             return 0; // If the ray doesn't hit the sphere, return 0
 
         // Compute the squared distance from the origin to the sphere's center
@@ -112,6 +151,33 @@ class sphere : public hittable {
     shared_ptr<material> mat;  // Pointer to the material of the sphere
     aabb bbox;  // The bounding box of the sphere
 
+    // Nearest root of the ray-sphere quadratic inside ray_t, for a sphere centred at current_center
+    bool intersect(const ray& r, const point3& current_center, interval ray_t, double& root) const {
+        // Compute the vector from the ray's origin to the sphere's center
+        vec3 oc = current_center - r.origin();
+        // Compute quadratic coefficients for the sphere-ray intersection
+        auto a = r.direction().length_squared(); // The squared length of the ray direction
+        auto h = dot(r.direction(), oc);         // Projection of oc on the ray direction
+        auto c = oc.length_squared() - radius*radius; // Difference between oc squared and radius squared
+
+        // Calculate the discriminant to check if the ray intersects the sphere
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return false; // No intersection if the discriminant is negative
+
+        // Calculate the square root of the discriminant (used to find the roots)
+        auto sqrtd = std::sqrt(discriminant);
+
+        // Find the nearest root within the acceptable range
+        root = (h - sqrtd) / a;
+        if (!ray_t.surrounds(root)) {  // If the root is not in the range, try the other root
+            root = (h + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false; // If both roots are out of range, return false (no hit)
+        }
+        return true;
+    }
+
     // Utility function to calculate the UV coordinates of a point on the sphere
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         // p: A point on the surface of the sphere
@@ -128,8 +194,8 @@ class sphere : public hittable {
     // Utility function to generate a random direction towards the sphere
     static vec3 random_to_sphere(double radius, double distance_squared) {
         // Generate two random numbers between 0 and 1
-        auto r1 = random_double();
-        auto r2 = random_double();
+        double r1, r2;
+        random_double_2d(r1, r2);
         // Calculate the z-component of the random direction
         auto z = 1 + r2*(std::sqrt(1-radius*radius/distance_squared) - 1);
 
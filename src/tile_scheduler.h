@@ -0,0 +1,141 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// * Work-stealing scheduler for image tiles.
+// Every worker owns a contiguous range of task indices [begin, end), packed into one 64-bit
+// atomic so that both the owner and thieves can update it with a single CAS (no locks).
+// The owner pops from the front of its range; an idle worker steals the back half of the
+// largest range it can find. Expensive tiles (glass, smoke) therefore get spread over all
+// cores instead of stalling the thread that happened to be assigned their scanlines.
+class tile_scheduler {
+    public:
+        // num_threads <= 0 means "size to the hardware"
+        explicit tile_scheduler(int num_threads = 0) {
+            thread_count = num_threads > 0 ? num_threads : int(std::thread::hardware_concurrency());
+            if (thread_count < 1) thread_count = 1;
+        }
+
+        int size() const { return thread_count; }
+
+        // * Run task(index, worker_id) for every index in [0, count), blocking until all finish.
+        // If `label` is non-empty the calling thread prints lock-free progress to std::clog.
+        void run(int count, const std::function<void(int, int)>& task, const char* label = "Tiles") {
+            if (count <= 0) return;
+
+            int workers = std::min(thread_count, count);
+            std::unique_ptr<worker_range[]> ranges(new worker_range[workers]);
+
+            // Seed each worker with a contiguous block, so neighbouring tiles stay on one core
+            for (int w = 0; w < workers; w++) {
+                auto begin = uint32_t(int64_t(count) * w / workers);
+                auto end   = uint32_t(int64_t(count) * (w + 1) / workers);
+                ranges[w].bounds.store(pack(begin, end), std::memory_order_relaxed);
+            }
+
+            std::atomic<int> done{0};
+            std::mutex finish_mutex; // only taken once, by the worker that finishes the last task
+            std::condition_variable finished_cv;
+
+            auto worker_loop = [&](int id) {
+                int index;
+                // once nothing is left to pop or steal, every remaining index is already claimed
+                while (pop(ranges[id], index) || steal(ranges.get(), workers, id, index)) {
+                    task(index, id);
+                    if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+                        std::lock_guard<std::mutex> lock(finish_mutex);
+                        finished_cv.notify_all();
+                    }
+                }
+            };
+
+            std::vector<std::thread> threads;
+            threads.reserve(workers);
+            for (int w = 0; w < workers; w++)
+                threads.emplace_back(worker_loop, w);
+
+            // * progress report: the caller only reads an atomic counter, workers never block on it
+            if (label && *label) {
+                int last = -1;
+                std::unique_lock<std::mutex> lock(finish_mutex);
+                while (true) {
+                    int finished = done.load(std::memory_order_acquire);
+                    if (finished != last) {
+                        std::clog << "\r" << label << " remaining: " << (count - finished) << "    " << std::flush;
+                        last = finished;
+                    }
+                    if (finished >= count) break;
+                    // wake up for the next report, or as soon as the last task is done
+                    finished_cv.wait_for(lock, std::chrono::milliseconds(100),
+                                         [&] { return done.load(std::memory_order_acquire) >= count; });
+                }
+            }
+
+            for (auto& t : threads)
+                t.join();
+        }
+
+    private:
+        int thread_count;
+
+        struct alignas(64) worker_range { // one cache line per worker to avoid false sharing
+            std::atomic<uint64_t> bounds{0};
+        };
+
+        static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t(begin) << 32) | end; }
+        static uint32_t begin_of(uint64_t r) { return uint32_t(r >> 32); }
+        static uint32_t end_of(uint64_t r) { return uint32_t(r); }
+
+        // owner side: take the first index of its own range
+        static bool pop(worker_range& own, int& index) {
+            uint64_t r = own.bounds.load(std::memory_order_acquire);
+            while (begin_of(r) < end_of(r)) {
+                if (own.bounds.compare_exchange_weak(r, pack(begin_of(r) + 1, end_of(r)),
+                                                     std::memory_order_acq_rel)) {
+                    index = int(begin_of(r));
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // thief side: take the back half of the fullest victim, run its first index right away
+        static bool steal(worker_range* ranges, int workers, int self, int& index) {
+            while (true) {
+                int victim = -1;
+                uint64_t victim_r = 0;
+                uint32_t best = 0;
+                for (int k = 1; k < workers; k++) {
+                    int w = (self + k) % workers;
+                    uint64_t r = ranges[w].bounds.load(std::memory_order_acquire);
+                    uint32_t left = end_of(r) > begin_of(r) ? end_of(r) - begin_of(r) : 0;
+                    if (left > best) { best = left; victim = w; victim_r = r; }
+                }
+                if (victim < 0) return false;
+
+                uint32_t b = begin_of(victim_r), e = end_of(victim_r);
+                uint32_t take = (e - b + 1) / 2;
+                uint32_t split = e - take;
+                if (ranges[victim].bounds.compare_exchange_strong(victim_r, pack(b, split),
+                                                                  std::memory_order_acq_rel)) {
+                    index = int(split);
+                    ranges[self].bounds.store(pack(split + 1, e), std::memory_order_release);
+                    return true;
+                }
+                // lost the race against the owner or another thief, look again
+            }
+        }
+};
+
+#endif
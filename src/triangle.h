@@ -11,15 +11,24 @@ public:
         : v0(v0), v1(v1), v2(v2), mat(mat) {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override;
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t;
+        return intersect(r, ray_t, t);
+    }
+    void hit_packet(ray_packet& packet, uint32_t lanes) const override {
+        packet_hit_triangle(packet, lanes, v0, v1 - v0, v2 - v0, this);
+    }
     aabb bounding_box() const override;
 
 private:
     vec3 v0, v1, v2;
     std::shared_ptr<material> mat;
+
+    bool intersect(const ray& r, interval ray_t, double& t) const;
 };
 
-// 实现 hit 函数
-bool Triangle::hit(const ray& r, interval ray_t, hit_record& rec) const {
+// Moller-Trumbore: the distance t of a hit in ray_t, nothing else
+bool Triangle::intersect(const ray& r, interval ray_t, double& t) const {
     vec3 edge1 = v1 - v0;
     vec3 edge2 = v2 - v0;
     vec3 h = cross(r.direction(), edge2);
@@ -35,17 +44,22 @@ bool Triangle::hit(const ray& r, interval ray_t, hit_record& rec) const {
     double v = f * dot(r.direction(), q);
     if (v < 0.0 || u + v > 1.0) return false;
 
-    double t = f * dot(edge2, q);
-    if (ray_t.surrounds(t)) {
-        rec.t = t;
-        rec.p = r.at(t);
-        vec3 outward_normal = unit_vector(cross(edge1, edge2));
-        rec.set_face_normal(r, outward_normal);  // 确保法线方向正确
-        rec.mat = mat;
-        return true;
-    }
+    t = f * dot(edge2, q);
+    return ray_t.surrounds(t);
+}
+
+// 实现 hit 函数
+bool Triangle::hit(const ray& r, interval ray_t, hit_record& rec) const {
+    double t;
+    if (!intersect(r, ray_t, t)) return false;
 
-    return false;
+    rec.t = t;
+    rec.p = r.at(t);
+    vec3 outward_normal = unit_vector(cross(v1 - v0, v2 - v0));
+    rec.set_face_normal(r, outward_normal);  // 确保法线方向正确
+    rec.mat = mat.get();
+    rec.primitive_id = object_id;
+    return true;
 }
 
 // bounding_box
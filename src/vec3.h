@@ -142,12 +142,14 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
+// * uniform point in the unit disk (plane z = 0) from exactly two draws (polar mapping), so a
+// * low-discrepancy sampler's 2D stratification carries over to the lens
 inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0); // 2D plane z = 0
-        if (p.length_squared() < 1)
-            return p;
-    }
+    double u1, u2;
+    random_double_2d(u1, u2);
+    auto r = std::sqrt(u1);
+    auto phi = 2 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
 }
 
 // * rejection method for random vector generation
@@ -160,8 +162,15 @@ inline vec3 random_in_unit_sphere() {
     }
 }
 
+// * uniform direction from exactly two draws (z uniform in [-1, 1], like Archimedes' hat box)
+// * instead of a rejection loop with a variable number of draws
 inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    double u1, u2;
+    random_double_2d(u1, u2);
+    auto z = 1 - 2 * u1;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 inline vec3 random_on_hemisphere(const vec3& normal) {
@@ -195,8 +204,8 @@ inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
 }
 
 inline vec3 random_cosine_direction() {
-    auto r1 = random_double();
-    auto r2 = random_double();
+    double r1, r2;
+    random_double_2d(r1, r2);
 
     auto phi = 2*pi*r1;
     auto x = std::cos(phi) * std::sqrt(r2);
@@ -0,0 +1,91 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "rtweekend.h"
+#include "aov.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// * State of one path between two bounces, shared by the depth-first camera::ray_color and
+// * the wavefront stages
+struct path_state {
+    ray r;                       // the ray leaving the last vertex (the camera ray at first)
+    color throughput;            // product of the weights of the vertices so far
+    color radiance;              // light gathered so far
+    double bsdf_pdf;             // density with which the last vertex sampled r's direction from its
+                                 // material, 0 for the camera and delta lobes (see shade_vertex)
+    aov_sample* aov = nullptr;   // receives the AOVs of the path, if any
+
+    void start(const ray& camera_ray, aov_sample* sample_aov) {
+        r = camera_ray;
+        throughput = color(1, 1, 1);
+        radiance = color(0, 0, 0);
+        bsdf_pdf = 0;
+        aov = sample_aov;
+        if (aov) *aov = aov_sample();
+    }
+};
+
+
+// * A batch of paths traced breadth-first (camera::sample_wavefront). Every bounce is a
+// * sequence of stages over all the live paths:
+//   - intersect: the rays of the live paths against the scene,
+//   - sort: the hits grouped by material kind with a stable counting sort (misses first),
+//   - shade: group after group, so each material's scatter code runs back to back instead of
+//     the kinds alternating at random from one sample to the next,
+//   - compact: the paths that go on, in slot order, are the rays of the next bounce.
+// Every path keeps its own random stream (rng), saved between stages: it draws the same
+// numbers as it would depth-first, so both integrators give the same image.
+// The vectors grow to the batch size once per thread and are reused (no allocation per path).
+struct wavefront_batch {
+    std::vector<path_state> paths;      // per slot
+    std::vector<rng_state> rng;
+    std::vector<hit_record> hits;
+    std::vector<uint8_t> hit_anything;
+    std::vector<uint8_t> group;         // 0: miss, 1 + material_kind otherwise
+    std::vector<uint8_t> alive;         // the path goes on after shading
+    std::vector<aov_sample> aov;        // only with AOVs
+    std::vector<int> pixel;             // block pixel of the slot's sample
+
+    std::vector<int> live;              // slots with a ray to trace, in slot order
+    std::vector<int> sorted;            // live slots grouped for shading
+    std::vector<int> next_live;
+
+    void reserve(int size, bool with_aov) {
+        if (int(paths.size()) < size) {
+            paths.resize(size);
+            rng.resize(size);
+            hits.resize(size);
+            hit_anything.resize(size);
+            group.resize(size);
+            alive.resize(size);
+            pixel.resize(size);
+            live.reserve(size);
+            sorted.resize(size);
+            next_live.reserve(size);
+        }
+        if (with_aov && int(aov.size()) < size)
+            aov.resize(size);
+    }
+
+    // * the live slots into `sorted`, grouped by hit_anything and material kind, each group
+    // * in slot order
+    void sort_by_material() {
+        std::array<int, material_kind_count + 2> offset{};
+        for (int s : live) {
+            group[s] = hit_anything[s] ? uint8_t(1 + int(hits[s].mat->kind())) : 0;
+            offset[group[s] + 1]++;
+        }
+        for (int g = 1; g < int(offset.size()); g++)
+            offset[g] += offset[g - 1];
+        for (int s : live)
+            sorted[offset[group[s]]++] = s;
+    }
+};
+
+#endif